@@ -0,0 +1,277 @@
+#include "genesis/genesis.hpp"
+
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+inline std::string json_escape( std::string const& str )
+{
+  std::string result;
+  result.reserve( str.size() );
+  for( auto const c : str ) {
+    if( c == '"' or c == '\\' ) {
+      result += '\\';
+    }
+    result += c;
+  }
+  return result;
+}
+
+/**
+ * Writes a jplace file incrementally, one pquery at a time, so that the output never has to
+ * exist as a whole Sample in memory. The layout follows the one of JplaceWriter.
+ *
+ * The file is only complete once finish() is called. This is not done on destruction, so that an
+ * error while writing leaves an invalid file instead of a valid but truncated one.
+ */
+class JplaceStreamWriter
+{
+public:
+  struct Placement {
+    size_t edge_num;
+    double likelihood;
+    double like_weight_ratio;
+    double distal_length;
+    double pendant_length;
+  };
+
+  using Name = std::pair< std::string, double >;
+
+  JplaceStreamWriter( std::ostream& os, std::string const& tree_string )
+      : os_( os )
+  {
+    os_ << std::setprecision( 15 );
+    os_ << "{\n  \"tree\": \"" << json_escape( tree_string ) << "\",\n  \"placements\": [\n";
+  }
+
+  /**
+   * The jplace tree string of a reference tree, with edge nums. It only depends on the tree,
+   * so it can be produced once and reused for every file written against that tree.
+   */
+  static std::string tree_string( genesis::placement::PlacementTree const& tree )
+  {
+    auto result = genesis::placement::PlacementTreeNewickWriter().to_string( tree );
+    while( not result.empty() and ( result.back() == '\n' or result.back() == '\r' ) ) {
+      result.pop_back();
+    }
+    return result;
+  }
+
+  void write_pquery( std::vector< Placement > const& placements, std::vector< Name > const& names )
+  {
+    begin_pquery();
+    for( size_t i = 0; i < placements.size(); ++i ) {
+      auto const& p = placements[ i ];
+      os_ << ( i ? ", " : "" ) << "[" << p.edge_num << ", " << p.likelihood << ", " << p.like_weight_ratio
+          << ", " << p.distal_length << ", " << p.pendant_length << "]";
+    }
+    os_ << "], \"nm\": [";
+    for( size_t i = 0; i < names.size(); ++i ) {
+      os_ << ( i ? ", " : "" ) << "[\"" << json_escape( names[ i ].first ) << "\", " << names[ i ].second << "]";
+    }
+    os_ << "]}";
+  }
+
+  /**
+   * Writes the placements of a pquery under the given name and multiplicity, ignoring the
+   * names of the pquery itself.
+   */
+  void write_pquery( genesis::placement::Pquery const& pquery, std::string const& name, double const multiplicity )
+  {
+    begin_pquery();
+    bool first = true;
+    for( auto const& p : pquery.placements() ) {
+      auto const branch_length = p.edge().data< genesis::placement::PlacementEdgeData >().branch_length;
+      os_ << ( first ? "" : ", " ) << "[" << p.edge_num() << ", " << p.likelihood << ", " << p.like_weight_ratio
+          << ", " << ( branch_length - p.proximal_length ) << ", " << p.pendant_length << "]";
+      first = false;
+    }
+    os_ << "], \"nm\": [[\"" << json_escape( name ) << "\", " << multiplicity << "]]}";
+  }
+
+  /**
+   * Adds a top level field to the file, with a value given as JSON text. Readers that do not know
+   * the field simply ignore it.
+   */
+  void add_field( std::string const& key, std::string const& json_value )
+  {
+    extra_fields_ += "  \"" + json_escape( key ) + "\": " + json_value + ",\n";
+  }
+
+  void finish()
+  {
+    if( finished_ ) {
+      return;
+    }
+    finished_ = true;
+    os_ << "\n  ],\n";
+    os_ << extra_fields_;
+    os_ << "  \"fields\": [ \"edge_num\", \"likelihood\", \"like_weight_ratio\", \"distal_length\", "
+           "\"pendant_length\" ],\n";
+    os_ << "  \"version\": 3,\n";
+    os_ << "  \"metadata\": { \"program\": \"genesis-apps\" }\n";
+    os_ << "}\n";
+    os_.flush();
+  }
+
+private:
+  void begin_pquery()
+  {
+    os_ << ( first_pquery_ ? "" : ",\n" ) << "    {\"p\": [";
+    first_pquery_ = false;
+  }
+
+  std::ostream& os_;
+  std::string extra_fields_;
+  bool first_pquery_ = true;
+  bool finished_     = false;
+};
+
+// -------------------------------------------------------------------------
+//     Multi-sample container
+// -------------------------------------------------------------------------
+
+/**
+ * One sample of a SampleContainer, as a view that shares the tree and the pqueries of the pooled
+ * sample instead of copying them. Its pqueries are those listed for the sample, each with the
+ * multiplicity it has in this sample.
+ */
+class ContainerSample
+{
+public:
+  ContainerSample( genesis::placement::Sample const& pooled,
+                   std::string const& name,
+                   std::vector< std::pair< size_t, double > > const& multiplicities )
+      : pooled_( pooled )
+      , name_( name )
+      , multiplicities_( multiplicities )
+  {
+  }
+
+  std::string const& name() const
+  {
+    return name_;
+  }
+
+  genesis::placement::PlacementTree const& tree() const
+  {
+    return pooled_.tree();
+  }
+
+  size_t size() const
+  {
+    return multiplicities_.size();
+  }
+
+  genesis::placement::Pquery const& pquery_at( size_t const index ) const
+  {
+    return pooled_.at( multiplicities_.at( index ).first );
+  }
+
+  double multiplicity_at( size_t const index ) const
+  {
+    return multiplicities_.at( index ).second;
+  }
+
+private:
+  genesis::placement::Sample const& pooled_;
+  std::string const& name_;
+  std::vector< std::pair< size_t, double > > const& multiplicities_;
+};
+
+/**
+ * Many samples that share the reference tree and the placements of their pqueries, and only
+ * differ in which pqueries they contain, with what multiplicity.
+ *
+ * On disk this is a jplace file with each pquery stored once, with its total multiplicity over all
+ * samples, plus a "samples" field holding the sample names and, per sample, a sparse list of
+ * [pquery index, multiplicity] pairs. Plain jplace readers see the pooled sample.
+ *
+ * Like a SampleSet, the samples are accessed by index, but as views on the pooled sample.
+ */
+struct SampleContainer {
+  genesis::placement::Sample sample;
+  std::vector< std::string > sample_names;
+  std::vector< std::vector< std::pair< size_t, double > > > multiplicities;
+
+  size_t size() const
+  {
+    return sample_names.size();
+  }
+
+  std::string const& name_at( size_t const index ) const
+  {
+    return sample_names.at( index );
+  }
+
+  ContainerSample at( size_t const index ) const
+  {
+    return ContainerSample( sample, sample_names.at( index ), multiplicities.at( index ) );
+  }
+};
+
+/**
+ * JSON value of the "samples" field of a container.
+ */
+inline std::string sample_container_field( std::vector< std::string > const& sample_names,
+                                           std::vector< std::vector< std::pair< size_t, double > > > const& multiplicities )
+{
+  std::ostringstream os;
+  os << std::setprecision( 15 );
+  os << "{\n    \"names\": [";
+  for( size_t i = 0; i < sample_names.size(); ++i ) {
+    os << ( i ? ", " : "" ) << "\"" << json_escape( sample_names[ i ] ) << "\"";
+  }
+  os << "],\n    \"multiplicities\": [";
+  for( size_t i = 0; i < multiplicities.size(); ++i ) {
+    os << ( i ? ",\n      [" : "\n      [" );
+    for( size_t k = 0; k < multiplicities[ i ].size(); ++k ) {
+      os << ( k ? ", " : "" ) << "[" << multiplicities[ i ][ k ].first << ", " << multiplicities[ i ][ k ].second << "]";
+    }
+    os << "]";
+  }
+  os << "\n    ]\n  }";
+  return os.str();
+}
+
+/**
+ * Reads a container, parsing the file only once: the "samples" field is taken from the JSON
+ * document, which is then handed to the JplaceReader for the pooled sample.
+ */
+inline SampleContainer read_sample_container( std::string const& file )
+{
+  using namespace genesis::utils;
+
+  SampleContainer result;
+  auto doc = JsonReader().read( from_file( file ) );
+
+  auto const& samples = doc.at( "samples" );
+  for( auto const& name : samples.at( "names" ).get_array() ) {
+    result.sample_names.push_back( name.get_string() );
+  }
+  for( auto const& column : samples.at( "multiplicities" ).get_array() ) {
+    result.multiplicities.emplace_back();
+    for( auto const& entry : column.get_array() ) {
+      auto const& pair = entry.get_array();
+      result.multiplicities.back().emplace_back( pair.at( 0 ).get_number< size_t >(), pair.at( 1 ).get_number< double >() );
+    }
+  }
+  if( result.sample_names.size() != result.multiplicities.size() ) {
+    throw std::runtime_error( "Sample names and multiplicities do not match in sample container " + file );
+  }
+
+  result.sample = genesis::placement::JplaceReader().read( doc );
+  for( auto const& column : result.multiplicities ) {
+    for( auto const& entry : column ) {
+      if( entry.first >= result.sample.size() ) {
+        throw std::runtime_error( "Invalid pquery index in sample container " + file );
+      }
+    }
+  }
+
+  return result;
+}
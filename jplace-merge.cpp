@@ -22,9 +22,22 @@
 
 #include "genesis/genesis.hpp"
 
+#include "jplace-common.hpp"
+
 #include <algorithm>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <map>
+#include <queue>
+#include <random>
+#include <sstream>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
 
 #ifdef GENESIS_OPENMP
 #include <omp.h>
@@ -48,13 +61,121 @@ void normalize( Sample& sample )
                  } );
 }
 
-Sample read_and_merge( std::vector< std::string > const& paths )
+/**
+ * Merges all pqueries that share a name, like merge_duplicates(), but finds the duplicates
+ * through a hash on the names instead of comparing pqueries pairwise. Sharing a name is
+ * transitive: a pquery that shares names with two others joins all three into one.
+ */
+void merge_duplicates_hashed( Sample& sample )
+{
+  size_t const n = sample.size();
+
+  // union-find over the pqueries, joined through the first pquery of every name. the root of
+  // each group is its first pquery, which is the one all others get merged into
+  std::vector< size_t > target( n );
+  auto find = [&]( size_t i ) {
+    while( target[ i ] != i ) {
+      target[ i ] = target[ target[ i ] ];
+      i           = target[ i ];
+    }
+    return i;
+  };
+
+  std::unordered_map< std::string, size_t > name_ids;
+  for( size_t i = 0; i < n; ++i ) {
+    target[ i ] = i;
+    for( auto const& name : sample.at( i ).names() ) {
+      auto const it = name_ids.emplace( name.name, i );
+      if( it.second ) {
+        continue;
+      }
+      auto const lhs = find( i );
+      auto const rhs = find( it.first->second );
+      if( lhs != rhs ) {
+        target[ std::max( lhs, rhs ) ] = std::min( lhs, rhs );
+      }
+    }
+  }
+  for( size_t i = 0; i < n; ++i ) {
+    target[ i ] = find( i );
+  }
+
+  // move names and placements of the duplicates into their target pquery
+  for( size_t i = 0; i < n; ++i ) {
+    if( target[ i ] == i ) {
+      continue;
+    }
+    auto& dup  = sample.at( i );
+    auto& dest = sample.at( target[ i ] );
+    for( auto const& name : dup.names() ) {
+      dest.add_name( name );
+    }
+    for( auto const& place : dup.placements() ) {
+      dest.add_placement( place );
+    }
+    dup.clear();
+  }
+
+// combining names and placements is independent per pquery
+#pragma omp parallel for schedule( dynamic )
+  for( size_t i = 0; i < n; ++i ) {
+    if( target[ i ] == i ) {
+      merge_duplicate_names( sample.at( i ) );
+      merge_duplicate_placements( sample.at( i ) );
+    }
+  }
+
+  // compact the sample, dropping the now empty duplicates
+  size_t kept = 0;
+  for( size_t i = 0; i < n; ++i ) {
+    if( target[ i ] == i ) {
+      if( kept != i ) {
+        sample.at( kept ) = std::move( sample.at( i ) );
+      }
+      ++kept;
+    }
+  }
+  if( kept < n ) {
+    sample.remove( kept, n );
+  }
+}
+
+/**
+ * Result of merging a subset of the input files.
+ */
+struct PartialSample {
+  Sample sample;
+  bool set = false;
+};
+
+/**
+ * Adds the pqueries of source to target. If target was not set yet, source is moved into it.
+ */
+void merge_into( PartialSample& target, Sample&& source )
+{
+  if( not target.set ) {
+    target.sample = std::move( source );
+    target.set    = true;
+    return;
+  }
+
+  try {
+    // The function only throws if something is wrong with the trees.
+    copy_pqueries( source, target.sample );
+  } catch( ... ) {
+    throw std::runtime_error( "Input jplace files have differing reference trees." );
+  }
+}
+
+Sample read_and_merge( std::vector< std::string > const& paths, size_t const num_threads )
 {
-  Sample result;
   size_t fc = 0;
 
+  // every thread accumulates its own partial result, so that reading and merging never waits
+  std::vector< PartialSample > partials( num_threads );
+
 // Read all jplace files and accumulate their pqueries.
-#pragma omp parallel for schedule( dynamic )
+#pragma omp parallel for schedule( dynamic ) num_threads( num_threads )
   for( size_t fi = 0; fi < paths.size(); ++fi ) {
     auto const& cur = paths.at( fi );
     // User output.
@@ -75,24 +196,33 @@ Sample read_and_merge( std::vector< std::string > const& paths )
       normalize( smpl );
     }
 
-// The main merging is single threaded.
-#pragma omp critical( GAPPA_JPLACE_INPUT_ACCUMULATE )
-    {
-      // Merge
-      if( result.empty() ) {
-        result = std::move( smpl );
-      } else {
-        try {
-          // The function only throws if something is wrong with the trees.
-          copy_pqueries( smpl, result );
-        } catch( ... ) {
-          throw std::runtime_error( "Input jplace files have differing reference trees." );
-        }
+    size_t thread = 0;
+#ifdef GENESIS_OPENMP
+    thread = omp_get_thread_num();
+#endif
+
+    merge_into( partials[ thread ], std::move( smpl ) );
+  }
+
+  // Combine the partials pairwise, halving their number in each round.
+  for( size_t stride = 1; stride < num_threads; stride *= 2 ) {
+    size_t const num_pairs = ( num_threads + 2 * stride - 1 ) / ( 2 * stride );
+
+#pragma omp parallel for schedule( dynamic ) num_threads( num_threads )
+    for( size_t k = 0; k < num_pairs; ++k ) {
+      size_t const lhs = k * 2 * stride;
+      size_t const rhs = lhs + stride;
+      if( rhs >= num_threads or not partials[ rhs ].set ) {
+        continue;
       }
+      merge_into( partials[ lhs ], std::move( partials[ rhs ].sample ) );
+      partials[ rhs ] = PartialSample();
     }
   }
 
-  merge_duplicates( result );
+  auto result = std::move( partials[ 0 ].sample );
+
+  merge_duplicates_hashed( result );
 
   if( true ) {
     normalize( result );
@@ -101,28 +231,341 @@ Sample read_and_merge( std::vector< std::string > const& paths )
   return result;
 }
 
+// -------------------------------------------------------------------------
+//     Streaming external merge
+// -------------------------------------------------------------------------
+
+/**
+ * Compact copy of a pquery for spilling to disk. Placements refer to the reference tree by
+ * edge index, as all inputs are required to share that tree.
+ */
+struct RunPlacement {
+  uint64_t edge_index;
+  double likelihood;
+  double like_weight_ratio;
+  double proximal_length;
+  double pendant_length;
+};
+
+struct RunPquery {
+  std::string key;
+  std::vector< std::pair< std::string, double > > names;
+  std::vector< RunPlacement > placements;
+};
+
+void write_string( std::ostream& os, std::string const& str )
+{
+  uint64_t const len = str.size();
+  os.write( reinterpret_cast< char const* >( &len ), sizeof( len ) );
+  os.write( str.data(), len );
+}
+
+bool read_string( std::istream& is, std::string& str )
+{
+  uint64_t len;
+  if( not is.read( reinterpret_cast< char* >( &len ), sizeof( len ) ) ) {
+    return false;
+  }
+  str.resize( len );
+  return static_cast< bool >( is.read( &str[ 0 ], len ) );
+}
+
+void write_run_pquery( std::ostream& os, RunPquery const& pq )
+{
+  write_string( os, pq.key );
+  uint64_t const num_names = pq.names.size();
+  os.write( reinterpret_cast< char const* >( &num_names ), sizeof( num_names ) );
+  for( auto const& name : pq.names ) {
+    write_string( os, name.first );
+    os.write( reinterpret_cast< char const* >( &name.second ), sizeof( name.second ) );
+  }
+  uint64_t const num_placements = pq.placements.size();
+  os.write( reinterpret_cast< char const* >( &num_placements ), sizeof( num_placements ) );
+  os.write( reinterpret_cast< char const* >( pq.placements.data() ), num_placements * sizeof( RunPlacement ) );
+}
+
+bool read_run_pquery( std::istream& is, RunPquery& pq )
+{
+  if( not read_string( is, pq.key ) ) {
+    return false;
+  }
+  uint64_t num_names;
+  is.read( reinterpret_cast< char* >( &num_names ), sizeof( num_names ) );
+  pq.names.resize( num_names );
+  for( auto& name : pq.names ) {
+    read_string( is, name.first );
+    is.read( reinterpret_cast< char* >( &name.second ), sizeof( name.second ) );
+  }
+  uint64_t num_placements;
+  is.read( reinterpret_cast< char* >( &num_placements ), sizeof( num_placements ) );
+  pq.placements.resize( num_placements );
+  is.read( reinterpret_cast< char* >( pq.placements.data() ), num_placements * sizeof( RunPlacement ) );
+  if( not is ) {
+    throw std::runtime_error( "Temporary run file is truncated." );
+  }
+  return true;
+}
+
+/**
+ * The temporary run files of one merge. Their names carry the process id and a random suffix, so
+ * that concurrent merges in the same directory do not collide, and they are deleted when this goes
+ * out of scope, also on errors.
+ */
+struct RunFiles {
+  explicit RunFiles( std::string const& tmp_dir )
+  {
+    std::random_device rd;
+    std::ostringstream name;
+    name << tmp_dir << "jplace-merge-" << getpid() << "-" << std::hex << rd() << "-run-";
+    prefix = name.str();
+  }
+
+  ~RunFiles()
+  {
+    for( auto const& file : files ) {
+      std::remove( file.c_str() );
+    }
+  }
+
+  std::string prefix;
+  std::vector< std::string > files;
+};
+
+/**
+ * Sorts the buffered pqueries by name and writes them as one more run file.
+ */
+void spill_run( std::vector< RunPquery >& buffer, RunFiles& run_files )
+{
+  std::sort( buffer.begin(), buffer.end(), []( RunPquery const& lhs, RunPquery const& rhs ) {
+    return lhs.key < rhs.key;
+  } );
+
+  auto const run  = run_files.files.size();
+  auto const file = run_files.prefix + std::to_string( run ) + ".tmp";
+  run_files.files.push_back( file );
+
+  std::ofstream os( file, std::ios::binary | std::ios::trunc );
+  if( not os ) {
+    throw std::runtime_error( "Cannot write temporary file: " + file );
+  }
+  for( auto const& pq : buffer ) {
+    write_run_pquery( os, pq );
+  }
+  os.close();
+  if( not os ) {
+    throw std::runtime_error( "Cannot write temporary file: " + file );
+  }
+  buffer.clear();
+
+  LOG_INFO << "Wrote run " << ( run + 1 ) << ": " << file;
+}
+
+/**
+ * Combines all copies of one pquery: multiplicities of equal names are summed, and placements
+ * on the same edge are merged like merge_duplicate_placements() does, that is, the weight ratios
+ * are summed and all other values averaged.
+ */
+void write_merged( JplaceStreamWriter& writer,
+                   PlacementTree const& reference,
+                   std::vector< RunPquery > const& copies,
+                   double const total_multiplicity )
+{
+  std::vector< JplaceStreamWriter::Name > names;
+  std::unordered_map< std::string, size_t > name_index;
+  for( auto const& pq : copies ) {
+    for( auto const& name : pq.names ) {
+      auto const ins = name_index.emplace( name.first, names.size() );
+      if( ins.second ) {
+        names.emplace_back( name.first, 0.0 );
+      }
+      names[ ins.first->second ].second += name.second / total_multiplicity;
+    }
+  }
+
+  std::map< uint64_t, std::pair< RunPlacement, size_t > > per_edge;
+  for( auto const& pq : copies ) {
+    for( auto const& place : pq.placements ) {
+      auto const ins = per_edge.emplace( place.edge_index, std::make_pair( place, size_t( 1 ) ) );
+      if( not ins.second ) {
+        auto& existing = ins.first->second.first;
+        existing.likelihood += place.likelihood;
+        existing.like_weight_ratio += place.like_weight_ratio;
+        existing.proximal_length += place.proximal_length;
+        existing.pendant_length += place.pendant_length;
+        ++ins.first->second.second;
+      }
+    }
+  }
+
+  std::vector< JplaceStreamWriter::Placement > placements;
+  for( auto const& entry : per_edge ) {
+    auto const& place  = entry.second.first;
+    double const count = static_cast< double >( entry.second.second );
+    auto const& edge   = reference.edge_at( place.edge_index );
+    auto const& data   = edge.data< PlacementEdgeData >();
+    placements.push_back( { data.edge_num(),
+                            place.likelihood / count,
+                            place.like_weight_ratio,
+                            data.branch_length - place.proximal_length / count,
+                            place.pendant_length / count } );
+  }
+
+  writer.write_pquery( placements, names );
+}
+
+/**
+ * Merges the jplace files with bounded memory: pqueries are collected into sorted runs of at most
+ * buffer_size pqueries, which are spilled to tmp_dir and then k-way merged into the output,
+ * combining duplicates on the fly. The output is ordered by pquery name.
+ *
+ * Pqueries are identified by their name. Unlike the in-memory merge, this cannot join pqueries
+ * that only share some of their names without an index of all names, so pqueries with several
+ * names are rejected.
+ */
+void stream_merge( std::vector< std::string > const& paths,
+                   size_t const buffer_size,
+                   std::string const& tmp_dir,
+                   std::ostream& out )
+{
+  PlacementTree reference;
+  std::vector< RunPquery > buffer;
+  RunFiles run_files( tmp_dir );
+  double total_multiplicity = 0.0;
+
+  for( size_t fi = 0; fi < paths.size(); ++fi ) {
+    LOG_INFO << "Reading file " << ( fi + 1 ) << " of " << paths.size() << ": " << paths[ fi ];
+
+    auto smpl = JplaceReader().read( from_file( paths[ fi ] ) );
+    if( fi == 0 ) {
+      reference = smpl.tree();
+    } else if( not compatible_trees( reference, smpl.tree() ) ) {
+      throw std::runtime_error( "Input jplace files have differing reference trees." );
+    }
+
+    // normalize per-sample
+    normalize( smpl );
+
+    for( auto const& pq : smpl ) {
+      if( pq.name_size() == 0 ) {
+        continue;
+      }
+      if( pq.name_size() > 1 ) {
+        throw std::runtime_error( "Pquery " + pq.name_at( 0 ).name + " in " + paths[ fi ]
+                                  + " has several names, which --stream does not support. "
+                                  + "Merge without --stream instead." );
+      }
+      RunPquery rpq;
+      rpq.key = pq.name_at( 0 ).name;
+      for( auto const& name : pq.names() ) {
+        rpq.names.emplace_back( name.name, name.multiplicity );
+        total_multiplicity += name.multiplicity;
+      }
+      for( auto const& p : pq.placements() ) {
+        rpq.placements.push_back(
+            { p.edge().index(), p.likelihood, p.like_weight_ratio, p.proximal_length, p.pendant_length } );
+      }
+      buffer.push_back( std::move( rpq ) );
+
+      if( buffer.size() >= buffer_size ) {
+        spill_run( buffer, run_files );
+      }
+    }
+  }
+  if( not buffer.empty() ) {
+    spill_run( buffer, run_files );
+  }
+  buffer.shrink_to_fit();
+
+  LOG_INFO << "Merging " << run_files.files.size() << " runs";
+
+  // k-way merge of the runs, by name
+  std::vector< std::ifstream > runs;
+  std::vector< RunPquery > heads( run_files.files.size() );
+  using HeapEntry = std::pair< std::string, size_t >;
+  std::priority_queue< HeapEntry, std::vector< HeapEntry >, std::greater< HeapEntry > > heap;
+
+  for( size_t r = 0; r < run_files.files.size(); ++r ) {
+    runs.emplace_back( run_files.files[ r ], std::ios::binary );
+    if( read_run_pquery( runs[ r ], heads[ r ] ) ) {
+      heap.emplace( heads[ r ].key, r );
+    }
+  }
+
+  JplaceStreamWriter writer( out, JplaceStreamWriter::tree_string( reference ) );
+  std::vector< RunPquery > copies;
+
+  while( not heap.empty() ) {
+    auto const r = heap.top().second;
+    heap.pop();
+
+    if( not copies.empty() and copies.front().key != heads[ r ].key ) {
+      write_merged( writer, reference, copies, total_multiplicity );
+      copies.clear();
+    }
+    copies.push_back( std::move( heads[ r ] ) );
+
+    heads[ r ] = RunPquery();
+    if( read_run_pquery( runs[ r ], heads[ r ] ) ) {
+      heap.emplace( heads[ r ].key, r );
+    }
+  }
+  if( not copies.empty() ) {
+    write_merged( writer, reference, copies, total_multiplicity );
+  }
+  writer.finish();
+}
+
 /**
  *  splits a jplace file into its  constituent samples, based on a standard OTU table
  */
 int main( int argc, char** argv )
 {
+  std::string const usage = std::string( "Usage: " ) + argv[ 0 ]
+                            + " [--threads <n>] [--stream [--buffer-size <pqueries>] [--tmp-dir <dir>]]"
+                            + " <jplace-files...>\n";
 
-  utils::Options::get().number_of_threads( 4 );
+  // Options, which precede the jplace files.
+  size_t num_threads = utils::Options::get().number_of_threads();
+  bool stream        = false;
+  size_t buffer_size = 1000000;
+  std::string tmp_dir( "." );
+
+  int arg = 1;
+  for( ; arg < argc and std::string( argv[ arg ] ).substr( 0, 2 ) == "--"; ++arg ) {
+    std::string const opt( argv[ arg ] );
+    if( opt == "--threads" and arg + 1 < argc ) {
+      num_threads = std::stoul( argv[ ++arg ] );
+    } else if( opt == "--stream" ) {
+      stream = true;
+    } else if( opt == "--buffer-size" and arg + 1 < argc ) {
+      buffer_size = std::stoul( argv[ ++arg ] );
+    } else if( opt == "--tmp-dir" and arg + 1 < argc ) {
+      tmp_dir = argv[ ++arg ];
+    } else {
+      throw std::runtime_error( "Unknown option: " + opt + "\n" + usage );
+    }
+  }
 
   // Check if the command line contains the right number of arguments.
-  if( argc < 2 ) {
-    throw std::runtime_error(
-        std::string( "Usage: " ) + argv[ 0 ] + " <jplace-files...>\n" );
+  if( argc - arg < 1 ) {
+    throw std::runtime_error( usage );
   }
 
+  num_threads = std::max< size_t >( num_threads, 1 );
+  utils::Options::get().number_of_threads( num_threads );
+
   // In out dirs.
   std::vector< std::string > jplace_paths;
-  for( int i = 1; i < argc; ++i ) {
+  for( int i = arg; i < argc; ++i ) {
     jplace_paths.push_back( std::string( argv[ i ] ) );
   }
 
-  JplaceReader jplace_reader;
-  auto sample = read_and_merge( jplace_paths );
+  if( stream ) {
+    stream_merge( jplace_paths, std::max< size_t >( buffer_size, 1 ), dir_normalize_path( tmp_dir ), std::cout );
+    return 0;
+  }
+
+  auto sample = read_and_merge( jplace_paths, num_threads );
 
   JplaceWriter().write( sample, to_stream( std::cout ) );
 
@@ -22,12 +22,19 @@
 
 #include "genesis/genesis.hpp"
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <string>
 #include <unordered_map>
 #include <numeric>
+#include <utility>
 #include <vector>
 
+#ifdef GENESIS_OPENMP
+#include <omp.h>
+#endif
+
 using namespace genesis;
 using namespace genesis::placement;
 using namespace genesis::tree;
@@ -45,23 +52,42 @@ std::ostream& operator<<( std::ostream& os, stats const& s )
   return os;
 }
 
-std::ostream& operator<<( std::ostream& os, std::unordered_map<std::string, size_t> const& map )
-{
-  for( auto const& elem : map ) {
-    os << "  " << std::to_string(elem.second) << " x " << elem.first << "\n";
+/**
+ * Running mean and (population) standard deviation after Welford, so that the values themselves
+ * never have to be kept. Partial results are combined after Chan et al.
+ */
+struct running_stats {
+  size_t count = 0;
+  double mean  = 0.0;
+  double m2    = 0.0;
+
+  void add( double const x )
+  {
+    ++count;
+    auto const delta = x - mean;
+    mean += delta / count;
+    m2 += delta * ( x - mean );
   }
 
-  return os;
-}
+  void merge( running_stats const& other )
+  {
+    if( other.count == 0 ) {
+      return;
+    }
+    auto const total = count + other.count;
+    auto const delta = other.mean - mean;
+    mean += delta * other.count / total;
+    m2 += other.m2 + delta * delta * count * other.count / total;
+    count = total;
+  }
+};
 
-static stats get_stats(std::vector<double> const& v)
+static stats get_stats( running_stats const& r )
 {
-
-  auto stddevpair = mean_stddev(v);
   stats res;
 
-  res.mean = stddevpair.mean;
-  res.stddev = stddevpair.stddev;
+  res.mean   = r.mean;
+  res.stddev = r.count ? std::sqrt( r.m2 / r.count ) : 0.0;
 
   return res;
 }
@@ -73,12 +99,87 @@ struct signal {
 
   size_t sum() const { return weak + possible + strong; };
 
-  std::vector<double> best_hits;
-  std::vector<double> entropies;
-  std::unordered_map<std::string, size_t> closest_hit_label;
+  running_stats best_hits;
+  running_stats entropies;
+
+  // count per label id, only for the labels that were hit
+  std::unordered_map<size_t, size_t> closest_hit_label;
+
+  void merge( signal const& other )
+  {
+    weak += other.weak;
+    possible += other.possible;
+    strong += other.strong;
+    best_hits.merge( other.best_hits );
+    entropies.merge( other.entropies );
+    for( auto const& entry : other.closest_hit_label ) {
+      closest_hit_label[ entry.first ] += entry.second;
+    }
+  }
+};
+
+/**
+ * Dense ids for the query names and leaf labels, so that the per-sample work only deals in indices.
+ */
+struct Interning {
+  std::vector<std::string> query_names;
+  std::unordered_map<std::string, size_t> query_ids;
 
+  std::vector<std::string> labels;
+  std::unordered_map<std::string, size_t> label_ids;
 };
 
+/**
+ * Labels that are not in the tree of sample 0, as seen by one thread. Their ids follow the ones
+ * of that tree, and only get their final value when the threads are merged.
+ */
+struct LocalLabels {
+  std::vector<std::string> labels;
+  std::unordered_map<std::string, size_t> label_ids;
+};
+
+static Interning intern( Sample const& sample )
+{
+  Interning result;
+  for( auto const& pq : sample ) {
+    auto const& name = pq.name_at( 0 ).name;
+    if( result.query_ids.emplace( name, result.query_names.size() ).second ) {
+      result.query_names.push_back( name );
+    }
+  }
+
+  for( auto const& node : sample.tree().nodes() ) {
+    auto const& label = node.data<PlacementNodeData>().name;
+    if( result.label_ids.emplace( label, result.labels.size() ).second ) {
+      result.labels.push_back( label );
+    }
+  }
+  return result;
+}
+
+static size_t label_id( std::string const& label, Interning const& ids, LocalLabels& local )
+{
+  auto const it = ids.label_ids.find( label );
+  if( it != ids.label_ids.end() ) {
+    return it->second;
+  }
+  auto const lt = local.label_ids.emplace( label, ids.labels.size() + local.labels.size() );
+  if( lt.second ) {
+    local.labels.push_back( label );
+  }
+  return lt.first->second;
+}
+
+static void print_labels( std::ostream& os, std::unordered_map<size_t, size_t> const& counts, Interning const& ids )
+{
+  // in label id order, so that the output does not depend on the hash map
+  std::vector<std::pair<size_t, size_t>> sorted( counts.begin(), counts.end() );
+  std::sort( sorted.begin(), sorted.end() );
+  for( auto const& entry : sorted ) {
+    os << "  " << std::to_string( entry.second ) << " x " << ids.labels[ entry.first ] << "\n";
+  }
+}
+
 constexpr double STRONG   = 0.5;
 constexpr double WEAK     = 0.15;
 constexpr double MAJORITY = 2.0 / 3.0;
@@ -98,75 +199,160 @@ static double get_entropy( Pquery const& pq )
  */
 int main( int argc, char** argv )
 {
-  if( argc < 2 ) {
-    throw std::runtime_error(
-        std::string( "Usage: " ) + argv[ 0 ] + " <jplace-files...>\n" );
+  std::string const usage = std::string( "Usage: " ) + argv[ 0 ] + " [--threads <n>] <jplace-files...>\n";
+
+  size_t num_threads = Options::get().number_of_threads();
+
+  int arg = 1;
+  for( ; arg < argc and std::string( argv[ arg ] ).substr( 0, 2 ) == "--"; ++arg ) {
+    std::string const opt( argv[ arg ] );
+    if( opt == "--threads" and arg + 1 < argc ) {
+      num_threads = std::stoul( argv[ ++arg ] );
+    } else {
+      throw std::runtime_error( "Unknown option: " + opt + "\n" + usage );
+    }
+  }
+
+  if( argc - arg < 1 ) {
+    throw std::runtime_error( usage );
   }
 
   std::vector< std::string > jplace_files;
-  for( int i = 1; i < argc; ++i ) {
+  for( int i = arg; i < argc; ++i ) {
     jplace_files.emplace_back( argv[ i ] );
   }
-  SampleSet samples = JplaceReader().read( from_files( jplace_files ) );
 
-  std::unordered_map< std::string, signal > results;
-  // add entry for each outgroup in sample 0
-  for( auto const& pq : samples[ 0 ] ) {
-    auto const& name = pq.name_at( 0 );
-    results[ name ];
-  }
+  // the files are read one at a time by each thread, so that only as many samples as there are
+  // threads are ever held in memory. the first one is kept, as it defines the ids.
+  Sample first_sample = JplaceReader().read( from_file( jplace_files[ 0 ] ) );
+
+  // one id per outgroup in sample 0, and per distinct label in its reference tree
+  auto ids               = intern( first_sample );
+  auto const num_queries = first_sample.size();
+
+  num_threads = std::max< size_t >( std::min( num_threads, jplace_files.size() ), 1 );
+
+  // per-thread signal tables, indexed by query id. the static schedule hands each thread a
+  // contiguous block of samples, so merging the tables in thread order gives the same result
+  // for a given number of threads.
+  // all tables are sized up front, as the runtime may start fewer threads than asked for.
+  std::vector< std::vector< signal > > partials( num_threads, std::vector< signal >( ids.query_names.size() ) );
+  std::vector< LocalLabels > local_labels( num_threads );
+  std::vector< std::string > errors( num_threads );
+
+#pragma omp parallel num_threads( num_threads )
+  {
+#ifdef GENESIS_OPENMP
+    size_t const t = omp_get_thread_num();
+#else
+    size_t const t = 0;
+#endif
+    auto& results = partials[ t ];
+
+#pragma omp for schedule( static )
+    for( size_t i = 0; i < jplace_files.size(); ++i ) {
+      if( not errors[ t ].empty() ) {
+        continue;
+      }
+      auto const& sample_name = jplace_files[ i ];
+      Sample sample;
+      try {
+        sample = ( i == 0 ) ? std::move( first_sample ) : JplaceReader().read( from_file( sample_name ) );
+      } catch( std::exception const& e ) {
+        errors[ t ] = sample_name + ": " + e.what();
+        continue;
+      }
 
-  auto const num_queries = samples[ 0 ].size();
-  for( size_t i = 0; i < samples.size(); ++i ) {
-    auto const& sample_name = samples.name_at( i );
-    // std::cout << sample_name << "\n";
-    auto& sample = samples[ i ];
+      if( sample.size() != num_queries ) {
+        errors[ t ] = std::string( "jplace files must have equal number of queries! Conflicting sample: " )
+                      + sample_name;
+        continue;
+      }
 
-    if( sample.size() != num_queries ) {
-      throw std::runtime_error(
-          std::string( "jplace files must have equal number of queries! Conflicting sample: " )
-          + sample_name );
+      for( size_t k = 0; k < sample.size(); ++k ) {
+        auto& pq         = sample.at( k );
+        auto const& name = pq.name_at( 0 ).name;
+
+        // the queries usually come in the same order as in sample 0, which spares the lookup
+        size_t id = k;
+        if( k >= ids.query_names.size() or ids.query_names[ k ] != name ) {
+          auto const elem = ids.query_ids.find( name );
+
+          // fail if samples don't contain the same queries
+          if( elem == ids.query_ids.end() ) {
+            errors[ t ] = std::string( "Samples don't contain the same queries.\nOffending Query: " )
+                          + name + "\nOffending Sample: " + sample_name;
+            break;
+          }
+          id = elem->second;
+        }
+        auto& cur_signal = results[ id ];
+
+        sort_placements_by_weight( pq );
+
+        auto const best_hit_lwr = pq.placement_at( 0 ).like_weight_ratio;
+
+        if( best_hit_lwr > STRONG ) {
+          cur_signal.strong++;
+          // by the name in this sample's own tree, which need not be the tree of sample 0
+          auto const& edge  = pq.placement_at( 0 ).edge();
+          auto const& label = edge.secondary_node().data<PlacementNodeData>().name;
+          cur_signal.closest_hit_label[ label_id( label, ids, local_labels[ t ] ) ]++;
+        } else if( best_hit_lwr < WEAK ) {
+          cur_signal.weak++;
+        } else {
+          cur_signal.possible++;
+        }
+
+        cur_signal.best_hits.add( best_hit_lwr );
+
+        normalize_weight_ratios( pq );
+        cur_signal.entropies.add( get_entropy( pq ) );
+      }
     }
+  }
 
-    for( auto& pq : sample ) {
-      auto const& name = pq.name_at( 0 ).name;
-      auto elem        = results.find( name );
+  for( auto const& error : errors ) {
+    if( not error.empty() ) {
+      throw std::runtime_error( error );
+    }
+  }
 
-      // fail if samples don't contain the same queries
-      if( elem == results.end() ) {
-        throw std::runtime_error(
-            std::string( "Samples don't contain the same queries.\nOffending Query: " )
-            + name + "\nOffending Sample: " + sample_name );
+  // labels that only later trees have get their final ids in thread order
+  auto const num_tree_labels = ids.labels.size();
+  for( size_t t = 0; t < partials.size(); ++t ) {
+    if( local_labels[ t ].labels.empty() ) {
+      continue;
+    }
+    std::vector<size_t> remap;
+    for( auto const& label : local_labels[ t ].labels ) {
+      auto const it = ids.label_ids.emplace( label, ids.labels.size() );
+      if( it.second ) {
+        ids.labels.push_back( label );
       }
-      auto& cur_signal = elem->second;
-
-      sort_placements_by_weight( pq );
-
-      auto const best_hit_lwr = pq.placement_at( 0 ).like_weight_ratio;
-
-      if( best_hit_lwr > STRONG ) {
-        cur_signal.strong++;
-        auto const& edge = pq.placement_at( 0 ).edge();
-        // get the label if there is one
-        auto const& label = edge.secondary_node().data<PlacementNodeData>().name;
-        cur_signal.closest_hit_label[label]++;
-      } else if( best_hit_lwr < WEAK ) {
-        cur_signal.weak++;
-      } else {
-        cur_signal.possible++;
+      remap.push_back( it.first->second );
+    }
+    for( auto& signal : partials[ t ] ) {
+      std::unordered_map<size_t, size_t> counts;
+      for( auto const& entry : signal.closest_hit_label ) {
+        auto const id = entry.first < num_tree_labels ? entry.first : remap[ entry.first - num_tree_labels ];
+        counts[ id ] += entry.second;
       }
+      signal.closest_hit_label = std::move( counts );
+    }
+  }
 
-      cur_signal.best_hits.push_back( best_hit_lwr );
-
-      normalize_weight_ratios( pq );
-      cur_signal.entropies.push_back( get_entropy( pq ) );
+  auto& results = partials[ 0 ];
+  for( size_t t = 1; t < partials.size(); ++t ) {
+    for( size_t id = 0; id < ids.query_names.size(); ++id ) {
+      results[ id ].merge( partials[ t ][ id ] );
     }
   }
 
-  // print result
-  for( auto const& result : results ) {
-    auto const& query     = result.first;
-    auto const& signal    = result.second;
+  // print result, in the order of the queries in sample 0
+  for( size_t id = 0; id < ids.query_names.size(); ++id ) {
+    auto const& query     = ids.query_names[ id ];
+    auto const& signal    = results[ id ];
     auto const sum        = signal.sum();
     size_t const majority = sum * MAJORITY;
 
@@ -178,7 +364,7 @@ int main( int argc, char** argv )
       std::cout << " is majority \"possible\" (" << std::to_string( signal.possible ) << " / " << std::to_string( sum ) << ")\n";
     } else if( signal.strong > majority ) {
       std::cout << " is majority \"strong\" (" << std::to_string( signal.strong ) << " / " << std::to_string( sum ) << "):\n";
-      std::cout << signal.closest_hit_label;
+      print_labels( std::cout, signal.closest_hit_label, ids );
     } else {
       std::cout << " is inconclusive ("
                 << std::to_string( signal.strong ) << ", "
@@ -22,9 +22,16 @@
 
 #include "genesis/genesis.hpp"
 
+#include "lca-distance.hpp"
+
 #include <algorithm>
 #include <fstream>
+#include <iomanip>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 using namespace genesis;
 using namespace genesis::placement;
@@ -38,33 +45,338 @@ void fail( bool const failure_condition, std::string const& msg )
   }
 }
 
-void prune_and_move_placements( Sample& sample,
-                                std::string const& prune_label ) {
-  auto& tree = sample.tree();
-  // search for the leaf node of the given label
-  auto leaf_node  = find_node( tree, prune_label );
-  fail( not leaf_node, "Given label was not found in the tree." );
+/**
+ * Removes all leaves with the given labels at once, and collapses the inner nodes that become
+ * linear. Placements on edges that get merged keep their position along the merged edge.
+ * Placements in removed parts of the tree are moved to the point where that part was attached,
+ * with the distance to that point added to their pendant length.
+ *
+ * The pruned tree is built directly from the kept links, nodes and edges, keeping their data and
+ * the orientation towards the original root.
+ */
+void prune_and_move_placements( Sample& sample, std::vector< std::string > const& prune_labels )
+{
+  auto const& tree      = sample.tree();
+  auto const node_count = tree.node_count();
+
+  // preorder, with parents, children and distances from the root
+  std::vector< size_t > order;
+  std::vector< size_t > parent( node_count, node_count );
+  std::vector< std::vector< size_t > > children( node_count );
+  std::vector< double > root_dist( node_count, 0.0 );
+  order.reserve( node_count );
+  for( auto it : preorder( tree ) ) {
+    auto const v = it.node().index();
+    order.push_back( v );
+    if( it.is_first_iteration() ) {
+      continue;
+    }
+    auto const& edge = it.edge();
+    auto const p     = edge.primary_node().index();
+    parent[ v ]      = p;
+    children[ p ].push_back( v );
+    root_dist[ v ] = root_dist[ p ] + edge.data< CommonEdgeData >().branch_length;
+  }
+  auto const root = order[ 0 ];
+
+  // mark the leaves to remove, and count the remaining leaves below every node
+  std::unordered_set< std::string > const prune_set( prune_labels.begin(), prune_labels.end() );
+  std::vector< size_t > alive( node_count, 0 );
+  size_t found = 0;
+  for( auto const v : order ) {
+    if( v == root or not children[ v ].empty() ) {
+      continue;
+    }
+    if( prune_set.count( tree.node_at( v ).data< CommonNodeData >().name ) ) {
+      ++found;
+    } else {
+      alive[ v ] = 1;
+    }
+  }
+  fail( found < prune_set.size(), "Given label was not found in the tree." );
 
-  auto& edge      = leaf_node->primary_edge();
-  auto& base_node = leaf_node->link().outer().node();
+  for( size_t i = order.size(); i-- > 1; ) {
+    alive[ parent[ order[ i ] ] ] += alive[ order[ i ] ];
+  }
+  auto const total = alive[ root ];
+
+  // the remaining tree consists of the nodes on paths between remaining leaves. its top is
+  // their lowest common ancestor. of its nodes, those that lost a neighbour and end up with exactly
+  // two get collapsed into the edges around them, and all others are kept. the root of a rooted
+  // tree already has two neighbours, and stays as it is unless one of them goes away.
+  std::vector< char > in_tree( node_count, false );
+  std::vector< char > kept( node_count, false );
+  std::vector< size_t > live_children( node_count, 0 );
+  size_t top = node_count;
+  for( auto const v : order ) {
+    for( auto const c : children[ v ] ) {
+      live_children[ v ] += ( alive[ c ] > 0 );
+    }
+    in_tree[ v ] = alive[ v ] > 0 and ( alive[ v ] < total or live_children[ v ] >= 2 );
+    auto const degree     = live_children[ v ] + ( alive[ v ] < total );
+    auto const old_degree = children[ v ].size() + ( v != root );
+    kept[ v ]             = in_tree[ v ] and ( degree != 2 or degree == old_degree );
+    if( in_tree[ v ] and alive[ v ] == total ) {
+      top = v;
+    }
+  }
 
-  // find all placements that belong to this edge
-  auto cur_placements = placements_per_edge( sample, edge );
+  // lowest kept node of the chain that every collapsed node belongs to
+  std::vector< size_t > low( node_count, node_count );
+  for( size_t i = order.size(); i-- > 0; ) {
+    auto const v = order[ i ];
+    if( not in_tree[ v ] ) {
+      continue;
+    }
+    low[ v ] = v;
+    if( not kept[ v ] ) {
+      for( auto const c : children[ v ] ) {
+        if( alive[ c ] > 0 ) {
+          low[ v ] = low[ c ];
+        }
+      }
+    }
+  }
 
-  // remove leaf from tree
-  delete_leaf_node( tree, *leaf_node );
+  // if the top lost a neighbour and only has two left, its two edges become one, and an inner node at one
+  // of its ends becomes the new root
+  bool const merged = not kept[ top ];
+  size_t new_root   = top;
+  size_t lhs_end    = node_count;
+  size_t rhs_end    = node_count;
+  if( merged ) {
+    for( auto const c : children[ top ] ) {
+      if( alive[ c ] > 0 ) {
+        ( lhs_end == node_count ? lhs_end : rhs_end ) = low[ c ];
+      }
+    }
+    if( children[ lhs_end ].empty() ) {
+      std::swap( lhs_end, rhs_end );
+    }
+    new_root = lhs_end;
+  }
 
-  TreeEdge* new_edge;
-  // remove inner node
-  delete_linear_node( tree, base_node, [&new_edge]( TreeEdge& r_edge, TreeEdge& d_edge ) {
-    r_edge.data< CommonEdgeData >().branch_length += d_edge.data< CommonEdgeData >().branch_length;
-    new_edge = &r_edge;
-  } );
+  // nearest kept ancestor, which is the parent in the pruned tree
+  std::vector< size_t > up( node_count, node_count );
+  for( auto const v : order ) {
+    if( in_tree[ v ] and v != top ) {
+      up[ v ] = kept[ parent[ v ] ] ? parent[ v ] : up[ parent[ v ] ];
+    }
+  }
+  if( merged ) {
+    up[ lhs_end ] = node_count;
+    up[ rhs_end ] = lhs_end;
+  }
 
-  // transfer the placements to the new edge
-  for( auto& placement : cur_placements ) {
-    const_cast< PqueryPlacement* >(placement)->reset_edge( *new_edge );
+  auto new_length = [&]( size_t const v ) {
+    if( merged and v == rhs_end ) {
+      return root_dist[ lhs_end ] + root_dist[ rhs_end ] - 2.0 * root_dist[ top ];
+    }
+    return root_dist[ v ] - root_dist[ up[ v ] ];
+  };
+
+  // the pruned tree consists of the kept nodes, their links that lead into the remaining tree, and
+  // one edge above every kept node but the root, which is the original edge above that node. all of
+  // them keep the order of their original indices, and the edges their orientation, so that the
+  // result is laid out as if the leaves had been deleted from the tree one by one.
+  auto const link_count = tree.link_count();
+  auto const edge_count = tree.edge_count();
+  std::vector< size_t > new_link( link_count, link_count );
+  std::vector< size_t > new_node( node_count, node_count );
+  std::vector< size_t > new_edge( edge_count, edge_count );
+  std::vector< size_t > lower( edge_count, node_count );
+  size_t num_links = 0;
+  size_t num_nodes = 0;
+  size_t num_edges = 0;
+  for( size_t i = 0; i < link_count; ++i ) {
+    auto const& link = tree.link_at( i );
+    if( kept[ link.node().index() ] and in_tree[ link.outer().node().index() ] ) {
+      new_link[ i ] = num_links++;
+    }
   }
+  for( size_t v = 0; v < node_count; ++v ) {
+    if( kept[ v ] ) {
+      new_node[ v ] = num_nodes++;
+      if( v != new_root ) {
+        lower[ tree.node_at( v ).primary_link().edge().index() ] = v;
+      }
+    }
+  }
+  for( size_t e = 0; e < edge_count; ++e ) {
+    if( lower[ e ] != node_count ) {
+      new_edge[ e ] = num_edges++;
+    }
+  }
+  auto edge_above = [&]( size_t const v ) {
+    return new_edge[ tree.node_at( v ).primary_link().edge().index() ];
+  };
+
+  // the kept link at the other end of a link, passing through the collapsed nodes in between, each
+  // of which has exactly two links into the remaining tree
+  auto far_end = [&]( TreeLink const& link ) -> TreeLink const& {
+    auto const* end = &link.outer();
+    while( not kept[ end->node().index() ] ) {
+      auto const* through = &end->next();
+      while( not in_tree[ through->outer().node().index() ] ) {
+        through = &through->next();
+      }
+      end = &through->outer();
+    }
+    return *end;
+  };
+  auto next_kept = [&]( TreeLink const& link ) -> TreeLink const& {
+    auto const* next = &link.next();
+    while( new_link[ next->index() ] == link_count ) {
+      next = &next->next();
+    }
+    return *next;
+  };
+
+  PlacementTree pruned_tree;
+  auto& links = pruned_tree.expose_link_container();
+  auto& nodes = pruned_tree.expose_node_container();
+  auto& edges = pruned_tree.expose_edge_container();
+  for( size_t i = 0; i < num_links; ++i ) {
+    links.push_back( make_unique< TreeLink >() );
+    links.back()->reset_index( i );
+  }
+  for( size_t i = 0; i < num_nodes; ++i ) {
+    nodes.push_back( make_unique< TreeNode >() );
+    nodes.back()->reset_index( i );
+  }
+  for( size_t i = 0; i < num_edges; ++i ) {
+    edges.push_back( make_unique< TreeEdge >() );
+    edges.back()->reset_index( i );
+  }
+
+  for( size_t i = 0; i < link_count; ++i ) {
+    if( new_link[ i ] == link_count ) {
+      continue;
+    }
+    auto const& link  = tree.link_at( i );
+    auto const& outer = far_end( link );
+    auto const v      = link.node().index();
+
+    // every edge belongs to its lower end, and is reached from there through its primary link
+    bool const is_up  = ( v != new_root and &link == &tree.node_at( v ).primary_link() );
+    auto const& below = is_up ? link : outer;
+
+    auto& new_l = *links[ new_link[ i ] ];
+    new_l.reset_next( links[ new_link[ next_kept( link ).index() ] ].get() );
+    new_l.reset_outer( links[ new_link[ outer.index() ] ].get() );
+    new_l.reset_node( nodes[ new_node[ v ] ].get() );
+    new_l.reset_edge( edges[ new_edge[ below.edge().index() ] ].get() );
+  }
+
+  for( size_t v = 0; v < node_count; ++v ) {
+    if( not kept[ v ] ) {
+      continue;
+    }
+    auto const& node = tree.node_at( v );
+    auto& new_n      = *nodes[ new_node[ v ] ];
+    new_n.reset_data( node.data_ptr()->clone() );
+
+    // the root keeps its original primary link where it can, the others always do
+    auto const* primary = &node.primary_link();
+    if( new_link[ primary->index() ] == link_count ) {
+      primary = &next_kept( *primary );
+    }
+    new_n.reset_primary_link( links[ new_link[ primary->index() ] ].get() );
+    if( v == new_root ) {
+      pruned_tree.reset_root_link( links[ new_link[ primary->index() ] ].get() );
+      continue;
+    }
+
+    auto const& link = node.primary_link();
+    auto& new_e      = *edges[ edge_above( v ) ];
+    new_e.reset_primary_link( links[ new_link[ far_end( link ).index() ] ].get() );
+    new_e.reset_secondary_link( links[ new_link[ link.index() ] ].get() );
+    new_e.reset_data( link.edge().data_ptr()->clone() );
+    new_e.data< PlacementEdgeData >().branch_length = new_length( v );
+  }
+
+  // where every node of the remaining tree ends up: the edge it is on, the position along it,
+  // and whether that edge runs in the direction of the original tree or against it
+  std::vector< size_t > loc_edge( node_count, num_edges );
+  std::vector< double > loc_offset( node_count, 0.0 );
+  std::vector< double > loc_dir( node_count, 1.0 );
+  for( auto const v : order ) {
+    if( not in_tree[ v ] ) {
+      continue;
+    }
+    if( v == new_root and not merged ) {
+      loc_edge[ v ] = pruned_tree.root_link().edge().index();
+    } else if( merged and ( v == top or low[ v ] == lhs_end ) ) {
+      loc_edge[ v ]   = edge_above( rhs_end );
+      loc_offset[ v ] = root_dist[ lhs_end ] - root_dist[ v ];
+      loc_dir[ v ]    = -1.0;
+    } else if( merged and low[ v ] == rhs_end ) {
+      loc_edge[ v ]   = edge_above( rhs_end );
+      loc_offset[ v ] = root_dist[ lhs_end ] - 2.0 * root_dist[ top ] + root_dist[ v ];
+    } else {
+      loc_edge[ v ]   = edge_above( low[ v ] );
+      loc_offset[ v ] = root_dist[ v ] - root_dist[ up[ v ] ];
+    }
+  }
+
+  // for the removed parts: the node of the remaining tree they hang from, and, for the part above
+  // the top, where they branch off the path from the root to the top
+  std::vector< size_t > attach( node_count, top );
+  std::vector< char > below_top( node_count, false );
+  std::vector< char > on_path( node_count, false );
+  std::vector< size_t > branch( node_count, root );
+  for( size_t v = top; v != node_count; v = parent[ v ] ) {
+    on_path[ v ] = true;
+  }
+  for( auto const v : order ) {
+    auto const p   = parent[ v ];
+    attach[ v ]    = in_tree[ v ] ? v : ( v == root ? top : attach[ p ] );
+    below_top[ v ] = ( v == top ) or ( v != root and below_top[ p ] );
+    branch[ v ]    = ( on_path[ v ] or v == root ) ? v : branch[ p ];
+  }
+
+  // move all placements over in one sweep
+  reset_edge_nums( pruned_tree );
+  Sample pruned( pruned_tree );
+
+  for( auto const& pq : sample ) {
+    auto& new_pq = pruned.add();
+    for( auto const& name : pq.names() ) {
+      new_pq.add_name( name );
+    }
+    for( auto const& p : pq.placements() ) {
+      auto const& edge = p.edge();
+      auto const s     = edge.secondary_node().index();
+      auto const pos   = root_dist[ edge.primary_node().index() ] + p.proximal_length;
+      auto pendant     = p.pendant_length;
+
+      size_t at;
+      double offset;
+      if( in_tree[ s ] and s != top ) {
+        at     = s;
+        offset = loc_offset[ s ] - loc_dir[ s ] * ( root_dist[ s ] - pos );
+      } else {
+        at     = attach[ s ];
+        offset = loc_offset[ at ];
+        if( below_top[ s ] and s != top ) {
+          pendant += pos - root_dist[ at ];
+        } else if( on_path[ s ] ) {
+          pendant += root_dist[ top ] - pos;
+        } else {
+          auto const b = root_dist[ branch[ s ] ];
+          pendant += ( pos - b ) + ( root_dist[ top ] - b );
+        }
+      }
+
+      auto& new_edge  = pruned.tree().edge_at( loc_edge[ at ] );
+      auto& new_place = new_pq.add_placement( new_edge, p );
+      auto const bl   = new_edge.data< PlacementEdgeData >().branch_length;
+      new_place.proximal_length = std::min( std::max( offset, 0.0 ), bl );
+      new_place.pendant_length  = pendant;
+    }
+  }
+
+  sample = std::move( pruned );
 }
 
 /**
@@ -82,10 +394,11 @@ int main( int argc, char** argv )
 
 
   // Check if the command line contains the right number of arguments.
-  if( argc != 3 ) {
+  if( argc != 4 ) {
     throw std::runtime_error(
-        std::string( "Usage: " ) + argv[ 0 ] + " <jplace-file> <jplace-file-pruned>" );
+        std::string( "Usage: " ) + argv[ 0 ] + " <jplace-file> <jplace-file-pruned> <out-tsv>" );
   }
+  std::string const out_file = argv[ 3 ];
 
   LOG_INFO << "Started";
   
@@ -108,16 +421,19 @@ int main( int argc, char** argv )
   auto lhs_taxa = node_names( lhs.tree(), true );
   auto rhs_taxa = node_names( rhs.tree(), true );
 
+  std::unordered_set< std::string > const lhs_set( lhs_taxa.begin(), lhs_taxa.end() );
+  std::unordered_set< std::string > const rhs_set( rhs_taxa.begin(), rhs_taxa.end() );
+
   std::vector< std::string > missing_in_rhs;
   for( auto const& lhs_tax : lhs_taxa ) {
-    if( std::find(rhs_taxa.begin(), rhs_taxa.end(), lhs_tax) == rhs_taxa.end() ) {
+    if( rhs_set.count( lhs_tax ) == 0 ) {
       missing_in_rhs.push_back( lhs_tax );
     }
   }
 
   std::vector< std::string > missing_in_lhs;
   for( auto const& rhs_tax : rhs_taxa ) {
-    if( std::find(lhs_taxa.begin(), lhs_taxa.end(), rhs_tax) == lhs_taxa.end() ) {
+    if( lhs_set.count( rhs_tax ) == 0 ) {
       missing_in_lhs.push_back( rhs_tax );
     }
   }
@@ -137,55 +453,56 @@ int main( int argc, char** argv )
         "cannot prune this many leaves, would result in less than 4 taxa." );
   
   // prune out the extra taxa from the big tree
-  for( auto const& prune_label : to_prune ) {
-    prune_and_move_placements( big_sample, prune_label );
-  }
+  prune_and_move_placements( big_sample, to_prune );
   // ensure we re- calculate the indices so we can do the copy later
   reset_edge_nums( big_tree );
 
   fail( not compatible_trees( big_tree, small_tree ),
         "Trees are not compatible after prune" );
 
-  // postfix the big_sample pq's to disambiguate later
-  std::string postfix = "_cpy";
-  for( auto& pq : big_sample ) {
-    pq.name_at( 0 ).name += postfix;
-  }
-
-  // copy over pqueries from one to the other (big, which is now pruned, to small)
+  // copy over pqueries from one to the other (big, which is now pruned, to small).
+  // the copies are appended, so everything from num_small on is a copy.
+  auto const num_small = small_sample.size();
   copy_pqueries( big_sample, small_sample );
-  
-  // output node distance between all pairs of duplicates
-  auto node_path_lengths = node_path_length_matrix( small_sample.tree() );
-  std::vector< Pquery* > done;
-  for( auto const& pq : small_sample ) {
-    // check if current pq was already covered from the other direction
-    if( std::find( done.begin(), done.end(), &pq ) != done.end() ) {
-      continue;
-    }
-
-    auto& pq_name       = pq.name_at( 0 ).name;
-    auto other_pq_name  = pq_name + postfix;
-
-    // search for the other pquery of the same name
-    auto other_pq_ptr = find_pquery( small_sample, other_pq_name );
-    fail( other_pq_ptr == nullptr, "Could not find other pquery" );
-    auto& other_pq = *other_pq_ptr;
-
-    LOG_INFO << pq_name << " <-> " << other_pq_name;
-
-    auto& first_place   = pq.placement_at( 0 );
-    auto& second_place  = other_pq.placement_at( 0 );
 
+  // pair each copy with the pquery of the same name through a name index
+  std::unordered_map< std::string, size_t > small_index;
+  for( size_t i = 0; i < num_small; ++i ) {
+    small_index.emplace( small_sample.at( i ).name_at( 0 ).name, i );
+  }
 
-    LOG_INFO << " path distance: " << placement_path_length_distance( first_place,
-                                                                      second_place,
-                                                                      node_path_lengths );
-
+  std::vector< std::pair< size_t, size_t > > pairs;
+  pairs.reserve( small_sample.size() - num_small );
+  for( size_t i = num_small; i < small_sample.size(); ++i ) {
+    auto const it = small_index.find( small_sample.at( i ).name_at( 0 ).name );
+    fail( it == small_index.end(), "Could not find other pquery" );
+    pairs.emplace_back( it->second, i );
+  }
+  std::sort( pairs.begin(), pairs.end() );
+
+  // node distance between all pairs of duplicates
+  // (distance oracle instead of the full node_path_length_matrix, which is quadratic in memory)
+  LcaDistance const node_path_lengths( small_sample.tree() );
+  std::vector< size_t > distances( pairs.size() );
+
+#pragma omp parallel for schedule( static )
+  for( size_t i = 0; i < pairs.size(); ++i ) {
+    auto const& first_place  = small_sample.at( pairs[ i ].first ).placement_at( 0 );
+    auto const& second_place = small_sample.at( pairs[ i ].second ).placement_at( 0 );
+    distances[ i ] = placement_path_length_distance( first_place, second_place, node_path_lengths );
+  }
 
-    done.push_back( other_pq_ptr );
+  std::ofstream out( out_file );
+  fail( not out, "Cannot write to " + out_file );
+  out << std::setprecision( 15 );
+  out << "query\tpath_distance\n";
+  for( size_t i = 0; i < pairs.size(); ++i ) {
+    out << small_sample.at( pairs[ i ].first ).name_at( 0 ).name << "\t" << distances[ i ] << "\n";
   }
+  out.close();
+  fail( not out, "Failed writing to " + out_file );
 
+  LOG_INFO << "Wrote " << pairs.size() << " path distances to " << out_file;
   LOG_INFO << "Finished";
   return 0;
 }
@@ -0,0 +1,175 @@
+/*
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "genesis/genesis.hpp"
+
+#include "taxonomy-common.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace genesis;
+using namespace genesis::placement;
+using namespace genesis::tree;
+using namespace genesis::utils;
+
+void fail( bool const fail_if_true, std::string const& msg )
+{
+  if( fail_if_true ) {
+    throw std::runtime_error{ msg };
+  }
+}
+
+/**
+ * LWR weighted label of a pquery: every placement adds its LWR to the label of its edge and to all
+ * ancestors of that label in the taxonomy. The result is the deepest label whose support reaches
+ * the threshold, or the undetermined label if none does.
+ */
+std::pair< size_t, double > assign_pquery( Pquery const& pq,
+                                           TaxonomyTrie const& trie,
+                                           std::vector< size_t > const& edge_labels,
+                                           double const threshold )
+{
+  std::unordered_map< size_t, double > support;
+  for( auto const& p : pq.placements() ) {
+    for( auto id = edge_labels[ p.edge().index() ]; id != TaxonomyTrie::ROOT and id != TaxonomyTrie::QUERY_ID;
+         id = trie.parent( id ) ) {
+      support[ id ] += p.like_weight_ratio;
+    }
+  }
+
+  std::pair< size_t, double > best( TaxonomyTrie::ROOT, 0.0 );
+  for( auto const& entry : support ) {
+    if( entry.second < threshold ) {
+      continue;
+    }
+    auto const depth      = trie.depth( entry.first );
+    auto const best_depth = trie.depth( best.first );
+    if( best.first == TaxonomyTrie::ROOT or depth > best_depth
+        or ( depth == best_depth
+             and ( entry.second > best.second or ( entry.second == best.second and entry.first < best.first ) ) ) ) {
+      best = entry;
+    }
+  }
+  return best;
+}
+
+/**
+ *  Assigns taxonomic labels to the pqueries of a jplace file, based on a taxonomy file that labels
+ *  the reference taxa. Writes a per-query TSV and a per-taxon abundance profile.
+ */
+int main( int argc, char** argv )
+{
+  std::string const usage = std::string( "Usage: " ) + argv[ 0 ]
+                            + " [--threshold <lwr>] <jplace-file> <taxonomy_file> <out-prefix>\n"
+                            + "Where threshold is the accumulated LWR a label needs in order to be "
+                            + "assigned (default 0.5)\n";
+
+  double threshold = 0.5;
+
+  int arg = 1;
+  for( ; arg < argc and std::string( argv[ arg ] ).substr( 0, 2 ) == "--"; ++arg ) {
+    std::string const opt( argv[ arg ] );
+    if( opt == "--threshold" and arg + 1 < argc ) {
+      threshold = std::stod( argv[ ++arg ] );
+    } else {
+      throw std::runtime_error( "Unknown option: " + opt + "\n" + usage );
+    }
+  }
+
+  // Check if the command line contains the right number of arguments.
+  if( argc - arg != 3 ) {
+    throw std::runtime_error( usage );
+  }
+
+  // Activate logging.
+  Logging::log_to_stdout();
+  Logging::details.time = true;
+
+  std::string const jplace_file( argv[ arg ] );
+  std::string const taxon_file( argv[ arg + 1 ] );
+  std::string const out_prefix( argv[ arg + 2 ] );
+
+  auto const taxonomy = read_taxonomy( taxon_file );
+  auto const& trie    = taxonomy.trie;
+  auto const sample   = JplaceReader().read( from_file( jplace_file ) );
+  auto const& tree    = sample.tree();
+
+  LOG_INFO << "Read " << sample.size() << " pqueries and " << taxonomy.labels.size() << " taxa";
+
+  // label the reference once: every edge gets the consensus label of the taxa below it, and edges
+  // without any labelled taxa below them the one of their nearest labelled neighbour
+  auto node_labels = label_nodes( tree, taxonomy );
+  propagate_labels( tree, node_labels );
+
+  // indexed by edge index, as the edge nums of a jplace file need not be dense
+  std::vector< size_t > edge_labels( tree.edge_count() );
+  for( auto const& edge : tree.edges() ) {
+    edge_labels[ edge.index() ] = node_labels[ edge.secondary_node().index() ];
+  }
+
+  std::vector< std::pair< size_t, double > > assignments( sample.size() );
+
+#pragma omp parallel for schedule( dynamic, 256 )
+  for( size_t i = 0; i < sample.size(); ++i ) {
+    assignments[ i ] = assign_pquery( sample.at( i ), trie, edge_labels, threshold );
+  }
+
+  // per-query TSV, and the profile, with the multiplicities of the pqueries
+  std::ofstream per_query( out_prefix + "per_query.tsv" );
+  fail( not per_query, "Cannot write " + out_prefix + "per_query.tsv" );
+  per_query << "name\ttaxopath\tlwr\n";
+  std::unordered_map< size_t, double > abundances;
+  for( size_t i = 0; i < sample.size(); ++i ) {
+    auto const& pq     = sample.at( i );
+    auto const label   = trie.to_string( assignments[ i ].first );
+    double multiplicity = 0.0;
+    for( auto const& name : pq.names() ) {
+      per_query << name.name << "\t" << label << "\t" << assignments[ i ].second << "\n";
+      multiplicity += name.multiplicity;
+    }
+    abundances[ assignments[ i ].first ] += multiplicity;
+  }
+  per_query.close();
+  fail( not per_query, "Cannot write " + out_prefix + "per_query.tsv" );
+
+  std::map< std::string, double > profile;
+  double total = 0.0;
+  for( auto const& entry : abundances ) {
+    profile[ trie.to_string( entry.first ) ] += entry.second;
+    total += entry.second;
+  }
+
+  std::ofstream profile_out( out_prefix + "profile.tsv" );
+  fail( not profile_out, "Cannot write " + out_prefix + "profile.tsv" );
+  profile_out << "taxopath\tabundance\tfraction\n";
+  for( auto const& entry : profile ) {
+    profile_out << entry.first << "\t" << entry.second << "\t" << ( total > 0.0 ? entry.second / total : 0.0 ) << "\n";
+  }
+
+  profile_out.close();
+  fail( not profile_out, "Cannot write " + out_prefix + "profile.tsv" );
+
+  LOG_INFO << "Wrote " << out_prefix << "per_query.tsv and " << out_prefix << "profile.tsv";
+  return 0;
+}
@@ -0,0 +1,186 @@
+#include "genesis/genesis.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+/**
+ * Path lengths between the nodes of a tree, and between placements on it, in constant time per
+ * query, without the quadratic memory of node_path_length_matrix.
+ *
+ * Built from an Euler tour of the tree, a sparse table for range minimum queries over the depths
+ * along the tour, and the depth and branch length distance of every node from the root. The path
+ * length of two nodes is then depth(a) + depth(b) - 2 * depth(lca(a, b)), and likewise their
+ * branch length distance. Preprocessing takes O(N log N).
+ */
+class LcaDistance
+{
+public:
+  explicit LcaDistance( genesis::tree::Tree const& tree )
+  {
+    using namespace genesis::tree;
+
+    auto const node_count = tree.node_count();
+    root_dist_.assign( node_count, 0.0 );
+    depth_.assign( node_count, 0 );
+    first_.assign( node_count, 0 );
+
+    for( auto it : preorder( tree ) ) {
+      if( it.is_first_iteration() ) {
+        continue;
+      }
+      auto const& edge  = it.edge();
+      auto const node   = it.node().index();
+      auto const parent = edge.primary_node().index();
+      root_dist_[ node ] = root_dist_[ parent ] + edge.data< CommonEdgeData >().branch_length;
+      depth_[ node ]     = depth_[ parent ] + 1;
+    }
+
+    // every node appears in the tour once per link, so between the subtrees of two children
+    // their parent shows up, which is what the range minimum has to find.
+    std::vector< bool > seen( node_count, false );
+    std::vector< size_t > tour;
+    tour.reserve( tree.link_count() );
+    for( auto it : eulertour( tree ) ) {
+      auto const node = it.node().index();
+      if( not seen[ node ] ) {
+        seen[ node ]   = true;
+        first_[ node ] = tour.size();
+      }
+      tour.push_back( node );
+    }
+
+    // sparse table: level k holds, for each position, the shallowest node of the 2^k tour entries
+    // starting there.
+    auto const tour_size = tour.size();
+    table_.push_back( std::move( tour ) );
+    for( size_t k = 1; ( size_t( 1 ) << k ) <= tour_size; ++k ) {
+      auto const& prev = table_.back();
+      auto const half  = size_t( 1 ) << ( k - 1 );
+      std::vector< size_t > level( tour_size - ( size_t( 1 ) << k ) + 1 );
+      for( size_t i = 0; i < level.size(); ++i ) {
+        level[ i ] = shallower( prev[ i ], prev[ i + half ] );
+      }
+      table_.push_back( std::move( level ) );
+    }
+  }
+
+  /**
+   * Index of the lowest common ancestor of the nodes with the given indices.
+   */
+  size_t lca( size_t const a, size_t const b ) const
+  {
+    auto lo = first_[ a ];
+    auto hi = first_[ b ];
+    if( lo > hi ) {
+      std::swap( lo, hi );
+    }
+    auto const k = log2_floor( hi - lo + 1 );
+    return shallower( table_[ k ][ lo ], table_[ k ][ hi + 1 - ( size_t( 1 ) << k ) ] );
+  }
+
+  /**
+   * Number of edges between the nodes with the given indices, as in node_path_length_matrix.
+   */
+  size_t path_length( size_t const a, size_t const b ) const
+  {
+    return depth_[ a ] + depth_[ b ] - 2 * depth_[ lca( a, b ) ];
+  }
+
+  /**
+   * Branch length distance between the nodes with the given indices, as in
+   * node_branch_length_distance_matrix.
+   */
+  double branch_length_distance( size_t const a, size_t const b ) const
+  {
+    return root_dist_[ a ] + root_dist_[ b ] - 2.0 * root_dist_[ lca( a, b ) ];
+  }
+
+  /**
+   * Number of edges between the edges of two placements, the same as
+   * placement_path_length_distance() computes with a node_path_length_matrix: zero on the same
+   * edge, otherwise one more than the shortest path between their end nodes.
+   */
+  size_t path_length( genesis::placement::PqueryPlacement const& p_a,
+                      genesis::placement::PqueryPlacement const& p_b ) const
+  {
+    auto const& edge_a = p_a.edge();
+    auto const& edge_b = p_b.edge();
+    if( edge_a.index() == edge_b.index() ) {
+      return 0;
+    }
+
+    auto const prox_a = edge_a.primary_node().index();
+    auto const dist_a = edge_a.secondary_node().index();
+    auto const prox_b = edge_b.primary_node().index();
+    auto const dist_b = edge_b.secondary_node().index();
+    return 1 + std::min( { path_length( prox_a, prox_b ), path_length( prox_a, dist_b ),
+                           path_length( dist_a, prox_b ), path_length( dist_a, dist_b ) } );
+  }
+
+  /**
+   * Branch length distance between two placements: along the tree between the attachment points,
+   * plus both pendant lengths. This is a different metric than path_length(), not a replacement.
+   */
+  double branch_length_distance( genesis::placement::PqueryPlacement const& p_a,
+                                 genesis::placement::PqueryPlacement const& p_b ) const
+  {
+    using namespace genesis::tree;
+
+    auto const& edge_a = p_a.edge();
+    auto const& edge_b = p_b.edge();
+    double dist;
+
+    if( edge_a.index() == edge_b.index() ) {
+      dist = std::abs( p_a.proximal_length - p_b.proximal_length );
+    } else {
+      auto const bl_a     = edge_a.data< CommonEdgeData >().branch_length;
+      auto const bl_b     = edge_b.data< CommonEdgeData >().branch_length;
+      auto const prox_a   = edge_a.primary_node().index();
+      auto const dist_a   = edge_a.secondary_node().index();
+      auto const prox_b   = edge_b.primary_node().index();
+      auto const dist_b   = edge_b.secondary_node().index();
+      auto const distal_a = bl_a - p_a.proximal_length;
+      auto const distal_b = bl_b - p_b.proximal_length;
+
+      dist = std::min(
+          { p_a.proximal_length + branch_length_distance( prox_a, prox_b ) + p_b.proximal_length,
+            p_a.proximal_length + branch_length_distance( prox_a, dist_b ) + distal_b,
+            distal_a + branch_length_distance( dist_a, prox_b ) + p_b.proximal_length,
+            distal_a + branch_length_distance( dist_a, dist_b ) + distal_b } );
+    }
+
+    return dist + p_a.pendant_length + p_b.pendant_length;
+  }
+
+private:
+  size_t shallower( size_t const a, size_t const b ) const
+  {
+    return depth_[ a ] <= depth_[ b ] ? a : b;
+  }
+
+  static size_t log2_floor( size_t n )
+  {
+    size_t k = 0;
+    while( n >>= 1 ) {
+      ++k;
+    }
+    return k;
+  }
+
+  std::vector< double > root_dist_;
+  std::vector< size_t > depth_;
+  std::vector< size_t > first_;
+  std::vector< std::vector< size_t > > table_;
+};
+
+/**
+ * Drop-in for the node_path_length_matrix overload of placement_path_length_distance().
+ */
+inline size_t placement_path_length_distance( genesis::placement::PqueryPlacement const& p_a,
+                                              genesis::placement::PqueryPlacement const& p_b,
+                                              LcaDistance const& node_path_lengths )
+{
+  return node_path_lengths.path_length( p_a, p_b );
+}
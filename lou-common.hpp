@@ -0,0 +1,370 @@
+#include "genesis/genesis.hpp"
+
+#include <cassert>
+#include <cctype>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+inline void fail( bool const fail_if_true, std::string const& msg )
+{
+  if( fail_if_true ) {
+    throw std::runtime_error{ msg };
+  }
+}
+
+/**
+ * Position of a node in a newick string: its subtree text is [begin, end), of which [begin,
+ * label_end) is everything up to and including its name, and the rest its branch length.
+ */
+struct NewickSpan {
+  size_t begin     = 0;
+  size_t label_end = 0;
+  size_t end       = 0;
+  size_t parent    = 0;
+  std::string name;
+  std::vector< size_t > children;
+};
+
+/**
+ * Finds the span of every node in a newick string as written by CommonTreeNewickWriter.
+ * The result is in the postorder of the text, so the root is last. Spans are matched to the nodes
+ * of the tree through the leaf names, never through their position.
+ */
+inline std::vector< NewickSpan > newick_spans( std::string const& newick )
+{
+  std::vector< NewickSpan > result;
+  // open subtrees: their begin, and the already finished children
+  std::vector< std::pair< size_t, std::vector< size_t > > > open;
+  size_t pos = 0;
+
+  auto const is_delimiter = []( char c ) {
+    return c == ',' or c == '(' or c == ')' or c == ':' or c == ';' or c == '[' or c == '{';
+  };
+
+  // reads name, branch length, and any tags or comments of the node starting at begin
+  auto finish_node = [&]( size_t const begin, std::vector< size_t > children ) {
+    NewickSpan span;
+    span.begin = begin;
+    if( pos < newick.size() and newick[ pos ] == '\'' ) {
+      auto const close = newick.find( '\'', pos + 1 );
+      fail( close == std::string::npos, "Unterminated quote in newick string" );
+      span.name = newick.substr( pos + 1, close - pos - 1 );
+      pos       = close + 1;
+    } else {
+      auto const name_begin = pos;
+      while( pos < newick.size() and not is_delimiter( newick[ pos ] ) ) {
+        ++pos;
+      }
+      span.name = newick.substr( name_begin, pos - name_begin );
+    }
+    span.label_end = pos;
+    while( pos < newick.size() and newick[ pos ] != ',' and newick[ pos ] != ')' and newick[ pos ] != ';' ) {
+      if( newick[ pos ] == '[' or newick[ pos ] == '{' ) {
+        pos = newick.find( newick[ pos ] == '[' ? ']' : '}', pos );
+        fail( pos == std::string::npos, "Unterminated comment or tag in newick string" );
+      }
+      ++pos;
+    }
+    span.end      = pos;
+    span.children = std::move( children );
+    for( auto const c : span.children ) {
+      result[ c ].parent = result.size();
+    }
+    result.push_back( std::move( span ) );
+    return result.size() - 1;
+  };
+
+  while( pos < newick.size() and newick[ pos ] != ';' ) {
+    auto const c = newick[ pos ];
+    if( c == '(' ) {
+      open.emplace_back( pos, std::vector< size_t >() );
+      ++pos;
+    } else if( c == ',' ) {
+      ++pos;
+    } else if( c == ')' ) {
+      fail( open.empty(), "Unbalanced parentheses in newick string" );
+      ++pos;
+      auto subtree = std::move( open.back() );
+      open.pop_back();
+      auto const node = finish_node( subtree.first, std::move( subtree.second ) );
+      if( not open.empty() ) {
+        open.back().second.push_back( node );
+      }
+    } else if( std::isspace( static_cast< unsigned char >( c ) ) ) {
+      ++pos;
+    } else {
+      // a leaf
+      fail( open.empty(), "Invalid newick string" );
+      open.back().second.push_back( finish_node( pos, {} ) );
+    }
+  }
+  fail( not open.empty() or result.empty(), "Unbalanced parentheses in newick string" );
+  result.back().parent = result.size() - 1;
+  return result;
+}
+
+/**
+ * Where a leaf was attached before it got pruned, as written to original_location.csv.
+ */
+struct LeafLocation {
+  std::string name;
+  size_t edge_num = 0;
+  double pendant  = 0.0;
+  double proximal = 0.0;
+};
+
+inline void write_location( LeafLocation const& loc, std::string const& file )
+{
+  // write leaf name, edge_num, pendant and distal lengths
+  std::ofstream locfile( file );
+  locfile << "name,edge_num,pendant,proximal\n";
+  locfile << loc.name + ",";
+  locfile << std::to_string( loc.edge_num ) + ",";
+  locfile << std::to_string( loc.pendant ) + ",";
+  locfile << std::to_string( loc.proximal ) + "\n";
+  locfile.close();
+  fail( not locfile, "Cannot write " + file );
+}
+
+inline LeafLocation read_location( std::string const& file )
+{
+  std::ifstream locfile( file );
+  fail( not locfile, "Cannot open " + file );
+  std::string line;
+  std::getline( locfile, line );
+  std::getline( locfile, line );
+
+  // the name may contain commas, the numbers don't
+  auto const c3 = line.rfind( ',' );
+  auto const c2 = c3 == std::string::npos ? c3 : line.rfind( ',', c3 - 1 );
+  auto const c1 = c2 == std::string::npos ? c2 : line.rfind( ',', c2 - 1 );
+  fail( c1 == std::string::npos, "Invalid location file: " + file );
+
+  LeafLocation loc;
+  loc.name     = line.substr( 0, c1 );
+  loc.edge_num = std::stoul( line.substr( c1 + 1, c2 - c1 - 1 ) );
+  loc.pendant  = std::stod( line.substr( c2 + 1, c3 - c2 - 1 ) );
+  loc.proximal = std::stod( line.substr( c3 + 1 ) );
+  return loc;
+}
+
+/**
+ * The reference tree and alignment that all leave-one-out datasets are cut from, serialised once.
+ */
+struct LouReference {
+  LouReference( genesis::tree::CommonTree tree_in, genesis::sequence::SequenceSet msa_in )
+      : tree( std::move( tree_in ) )
+      , msa( std::move( msa_in ) )
+  {
+    using namespace genesis;
+
+    newick = tree::CommonTreeNewickWriter().to_string( tree );
+    spans  = newick_spans( newick );
+    for( size_t i = 0; i < spans.size(); ++i ) {
+      if( spans[ i ].children.empty() ) {
+        fail( not span_index.emplace( spans[ i ].name, i ).second, "Duplicate leaf name: " + spans[ i ].name );
+      }
+    }
+
+    // edge nums are the postorder ranks of the edges, which are the ranks of their lower nodes
+    postorder_rank.assign( tree.node_count(), 0 );
+    size_t rank = 0;
+    for( auto it : tree::postorder( tree ) ) {
+      if( not it.is_last_iteration() ) {
+        postorder_rank[ it.node().index() ] = rank++;
+      }
+    }
+
+    sequence::PhylipWriter().write( msa, utils::to_string( phylip ) );
+    // the header, and the line of every sequence, in the order of the msa
+    header_end = phylip.find( '\n' ) + 1;
+    line_begin.push_back( header_end );
+    while( line_begin.back() < phylip.size() ) {
+      auto const line_end = phylip.find( '\n', line_begin.back() );
+      line_begin.push_back( line_end == std::string::npos ? phylip.size() : line_end + 1 );
+    }
+    fail( header_end == 0 or line_begin.size() != msa.size() + 1,
+          "Unexpected phylip layout of the reference alignment" );
+    for( size_t i = 0; i < msa.size(); ++i ) {
+      fail( phylip.compare( line_begin[ i ], msa.at( i ).label().size(), msa.at( i ).label() ) != 0,
+            "Unexpected phylip layout of the reference alignment at " + msa.at( i ).label() );
+    }
+    // same header, with one sequence less
+    auto const count_end = phylip.find( ' ' );
+    ref_header           = std::to_string( msa.size() - 1 ) + phylip.substr( count_end, header_end - count_end );
+
+    // index of every sequence by label
+    for( size_t i = 0; i < msa.size(); ++i ) {
+      fail( not sequence_index.emplace( msa.at( i ).label(), i ).second,
+            "Duplicate sequence label: " + msa.at( i ).label() );
+    }
+  }
+
+  size_t sequence_at( std::string const& label ) const
+  {
+    auto const it = sequence_index.find( label );
+    fail( it == sequence_index.end(), "Sequence not found in MSA: " + label );
+    return it->second;
+  }
+
+  genesis::tree::CommonTree tree;
+  genesis::sequence::SequenceSet msa;
+
+  std::string newick;
+  std::vector< NewickSpan > spans;
+  std::unordered_map< std::string, size_t > span_index;
+  std::vector< size_t > postorder_rank;
+
+  std::string phylip;
+  size_t header_end = 0;
+  std::vector< size_t > line_begin;
+  std::string ref_header;
+  std::unordered_map< std::string, size_t > sequence_index;
+};
+
+/**
+ * Prunes the leaf from a copy of the tree, for the cases that a simple edit of the newick string
+ * does not cover: leaves next to the root, or next to a multifurcation.
+ */
+inline LeafLocation prune_leaf_copy( genesis::tree::CommonTree const& original_tree, size_t const id,
+                                     std::ostream* tree_out )
+{
+  using namespace genesis::tree;
+
+  // make a copy to manipulate (relatively costly but much safer than trying to undo changes)
+  CommonTree tree( original_tree );
+
+  auto& leaf_node = tree.node_at( id );
+  auto& base_node = leaf_node.link().outer().node();
+  assert( &leaf_node.link().next() == &leaf_node.link() );
+  assert( is_leaf( leaf_node ) );
+
+  LeafLocation loc;
+  loc.name = leaf_node.data< CommonNodeData >().name;
+  // track pendant and proximal length
+  loc.pendant  = leaf_node.primary_edge().data< CommonEdgeData >().branch_length;
+  loc.proximal = base_node.primary_edge().data< CommonEdgeData >().branch_length;
+
+  // remove leaf from tree
+  delete_leaf_node( tree, leaf_node );
+
+  // track edge that will become the leftover edge in the pruned tree
+  CommonTreeEdge* attach_edge_ptr = &base_node.primary_edge();
+
+  // remove
+  delete_linear_node( tree, base_node, []( TreeEdge& r_edge, TreeEdge& d_edge ) {
+    r_edge.data< CommonEdgeData >().branch_length += d_edge.data< CommonEdgeData >().branch_length;
+  } );
+
+  // determine edge_num of edge where we pruned
+  for( auto const& it : postorder( tree ) ) {
+    if( it.is_last_iteration() ) {
+      continue;
+    }
+
+    if( &it.edge() == attach_edge_ptr ) {
+      break;
+    } else {
+      loc.edge_num++;
+    }
+  }
+  fail( loc.edge_num >= edge_count( tree ),
+        std::to_string( loc.edge_num ) + " vs. " + std::to_string( edge_count( tree ) ) );
+
+  if( tree_out ) {
+    CommonTreeNewickWriter().write( tree, genesis::utils::to_stream( *tree_out ) );
+  }
+  return loc;
+}
+
+/**
+ * Location of the leaf with the given node index, and, if a stream is given, its pruned tree.
+ */
+inline LeafLocation prune_leaf( LouReference const& ref, size_t const id, std::ostream* tree_out )
+{
+  using namespace genesis::tree;
+
+  auto const& leaf_node = ref.tree.node_at( id );
+  auto const& base_node = leaf_node.link().outer().node();
+  auto const& leaf_name = leaf_node.data< CommonNodeData >().name;
+
+  auto const leaf_it = ref.span_index.find( leaf_name );
+  fail( leaf_it == ref.span_index.end(), "Leaf not found in the newick string: " + leaf_name );
+  auto const& base_span = ref.spans[ ref.spans[ leaf_it->second ].parent ];
+
+  bool const editable = &base_node != &ref.tree.root_node() and degree( base_node ) == 3
+                        and base_span.children.size() == 2;
+  if( not editable ) {
+    return prune_leaf_copy( ref.tree, id, tree_out );
+  }
+
+  // the sibling takes the place of the base node, with both branch lengths combined
+  auto const sibling   = base_span.children[ 0 ] == leaf_it->second ? base_span.children[ 1 ]
+                                                                     : base_span.children[ 0 ];
+  auto const& sib_span = ref.spans[ sibling ];
+
+  auto const& first_child = base_node.link().next();
+  auto const& sib_link    = ( &first_child.outer().node() == &leaf_node ) ? first_child.next() : first_child;
+  auto const& sib_node    = sib_link.outer().node();
+  fail( sib_span.name != sib_node.data< CommonNodeData >().name or sib_span.children.size() + 1 != degree( sib_node ),
+        "Newick string does not match the tree next to " + leaf_name );
+
+  LeafLocation loc;
+  loc.name     = leaf_name;
+  loc.pendant  = leaf_node.primary_edge().data< CommonEdgeData >().branch_length;
+  loc.proximal = base_node.primary_edge().data< CommonEdgeData >().branch_length;
+
+  // the sibling's edge is the one that remains, at the postorder rank of the sibling, minus the
+  // leaf if that came before it. the base node always comes after both.
+  auto const sib_rank  = ref.postorder_rank[ sib_node.index() ];
+  auto const leaf_rank = ref.postorder_rank[ leaf_node.index() ];
+  loc.edge_num         = sib_rank - ( leaf_rank < sib_rank ? 1 : 0 );
+
+  if( tree_out ) {
+    auto const merged = loc.proximal + sib_node.primary_edge().data< CommonEdgeData >().branch_length;
+    auto const& newick = ref.newick;
+    tree_out->write( newick.data(), base_span.begin );
+    tree_out->write( newick.data() + sib_span.begin, sib_span.label_end - sib_span.begin );
+    *tree_out << ":" << genesis::utils::to_string_precise( merged, 6 );
+    tree_out->write( newick.data() + base_span.end, newick.size() - base_span.end );
+  }
+  return loc;
+}
+
+/**
+ * The sequence of the leaf, unaligned, as a phylip file.
+ */
+inline void write_query( LouReference const& ref, std::string const& label, std::string const& file )
+{
+  using namespace genesis::sequence;
+
+  SequenceSet seq_set;
+  auto& seq = seq_set.add( ref.msa.at( ref.sequence_at( label ) ) );
+  remove_all_gaps( seq );
+
+  PhylipWriter().write( seq_set, genesis::utils::to_file( file ) );
+}
+
+/**
+ * The reference alignment without the sequence of the leaf, cut out of the shared phylip text.
+ */
+inline void write_reference( LouReference const& ref, std::string const& label, std::string const& file )
+{
+  auto const index = ref.sequence_at( label );
+
+  // one row less than the reference, which is what the header says
+  fail( ref.line_begin.size() != ref.msa.size() + 1 or index + 1 >= ref.line_begin.size(),
+        "Wrong row count when cutting " + label + " out of the reference alignment" );
+
+  std::ofstream ref_out( file );
+  ref_out << ref.ref_header;
+  ref_out.write( ref.phylip.data() + ref.header_end, ref.line_begin[ index ] - ref.header_end );
+  ref_out.write( ref.phylip.data() + ref.line_begin[ index + 1 ], ref.phylip.size() - ref.line_begin[ index + 1 ] );
+  ref_out.close();
+  fail( not ref_out, "Cannot write " + file );
+}
@@ -0,0 +1,85 @@
+/*
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "genesis/genesis.hpp"
+
+#include "lou-common.hpp"
+
+#include <fstream>
+#include <string>
+#include <unordered_map>
+
+using namespace genesis;
+using namespace genesis::sequence;
+using namespace genesis::tree;
+using namespace genesis::utils;
+
+/**
+ *  Produces the files of single leave-one-out datasets from the shared layout of lou-prep --shared:
+ *  pruned.newick, query.phylip and reference.phylip, next to the original_location.csv of the leaf.
+ */
+int main( int argc, char** argv )
+{
+  // Check if the command line contains the right number of arguments.
+  if( argc < 3 ) {
+    throw std::runtime_error(
+        std::string( "Usage: " ) + argv[ 0 ] + " <lou_dir> <leaf_ids...>\n"
+        + "Where lou_dir is the out_dir of lou-prep --shared, and the leaf ids are the names of "
+        + "the per-leaf directories in it.\n" );
+  }
+
+  Options::get().allow_file_overwriting( true );
+  Logging::log_to_stdout();
+
+  auto const lou_dir = dir_normalize_path( argv[ 1 ] );
+
+  auto tree = CommonTreeNewickReader().read( from_file( lou_dir + "base.newick" ) );
+  auto msa  = PhylipReader().read( from_file( lou_dir + "reference.phylip" ) );
+
+  fail( msa.size() != leaf_node_count( tree ),
+        "Tree and MSA must have same number of taxa" );
+
+  LouReference const ref( std::move( tree ), std::move( msa ) );
+
+  std::unordered_map< std::string, size_t > leaf_index;
+  for( auto const id : leaf_node_indices( ref.tree ) ) {
+    leaf_index.emplace( ref.tree.node_at( id ).data< CommonNodeData >().name, id );
+  }
+
+  for( int i = 2; i < argc; ++i ) {
+    auto const leaf_dir = dir_normalize_path( lou_dir + argv[ i ] );
+    auto const expected = read_location( leaf_dir + "original_location.csv" );
+
+    auto const leaf_it = leaf_index.find( expected.name );
+    fail( leaf_it == leaf_index.end(), "Leaf not found in the base tree: " + expected.name );
+
+    std::ofstream tree_out( leaf_dir + "pruned.newick" );
+    auto const loc = prune_leaf( ref, leaf_it->second, &tree_out );
+    tree_out.close();
+    fail( not tree_out, "Cannot write " + leaf_dir + "pruned.newick" );
+    fail( loc.edge_num != expected.edge_num,
+          "Attachment edge of " + expected.name + " does not match its original_location.csv" );
+
+    write_query( ref, loc.name, leaf_dir + "query.phylip" );
+    write_reference( ref, loc.name, leaf_dir + "reference.phylip" );
+
+    LOG_INFO << "Materialised " << leaf_dir;
+  }
+
+  return 0;
+}
@@ -22,34 +22,47 @@
 
 #include "genesis/genesis.hpp"
 
+#include "lou-common.hpp"
+
+#include <fstream>
 #include <string>
+#include <vector>
 
 using namespace genesis;
 using namespace genesis::sequence;
 using namespace genesis::tree;
 using namespace genesis::utils;
 
-void fail( bool const fail_if_true, std::string const& msg )
+int main( int argc, char** argv )
 {
-  if( fail_if_true ) {
-    throw std::runtime_error{ msg };
+  std::string const usage = std::string( "Usage: " ) + argv[ 0 ] + " [--shared] <newick> <fasta> <out_dir>\n"
+                            + "With --shared, the reference tree and alignment are written once into out_dir, "
+                            + "and every leaf's directory only holds its original_location.csv.\n"
+                            + "lou-materialise then produces the files of a leaf when they are needed.\n";
+
+  bool shared = false;
+
+  int arg = 1;
+  for( ; arg < argc and std::string( argv[ arg ] ).substr( 0, 2 ) == "--"; ++arg ) {
+    std::string const opt( argv[ arg ] );
+    if( opt == "--shared" ) {
+      shared = true;
+    } else {
+      throw std::runtime_error( "Unknown option: " + opt + "\n" + usage );
+    }
   }
-}
 
-int main( int argc, char** argv )
-{
   // Check if the command line contains the right number of arguments.
-  if( argc != 4 ) {
-    throw std::runtime_error(
-        std::string( "Usage: " ) + argv[ 0 ] + " <newick> <fasta> <out_dir>" );
+  if( argc - arg != 3 ) {
+    throw std::runtime_error( usage );
   }
 
   Options::get().allow_file_overwriting( true );
   Logging::log_to_stdout();
 
-  std::string tree_file( argv[ 1 ] );
-  std::string msa_file( argv[ 2 ] );
-  std::string out_dir( argv[ 3 ] );
+  std::string tree_file( argv[ arg ] );
+  std::string msa_file( argv[ arg + 1 ] );
+  std::string out_dir( argv[ arg + 2 ] );
 
   out_dir = dir_normalize_path( out_dir );
 
@@ -63,82 +76,55 @@ int main( int argc, char** argv )
   fail( not path_exists( out_dir ),
         "No such directory: " + out_dir );
 
+  // everything below is shared by all leaves and never changed: the tree and the reference
+  // alignment are written once, and every leaf's files are cut out of that text.
+  LouReference const ref( std::move( original_tree ), std::move( msa ) );
+
+  if( shared ) {
+    std::ofstream base_out( out_dir + "base.newick" );
+    base_out << ref.newick;
+    base_out.close();
+    fail( not base_out, "Cannot write " + out_dir + "base.newick" );
+
+    std::ofstream phylip_out( out_dir + "reference.phylip" );
+    phylip_out << ref.phylip;
+    phylip_out.close();
+    fail( not phylip_out, "Cannot write " + out_dir + "reference.phylip" );
+  }
+
   // for every leaf ID
-  auto leaf_ids = leaf_node_indices( original_tree );
-  for( auto id : leaf_ids ) {
-    // make a copy to manipulate (relatively costly but much safer than trying to undo changes)
-    CommonTree tree( original_tree );
-
-    auto& leaf_node = tree.node_at( id );
-    auto& base_node = leaf_node.link().outer().node();
-    assert( &leaf_node.link().next() == &leaf_node.link() );
-    assert( is_leaf( leaf_node ) );
-    // auto& prox_node = base_node.link().outer().node();
-
-    auto const leaf_name = leaf_node.data< CommonNodeData >().name;
-    // track pendant and proximal length
-    auto const pendant_length  = leaf_node.primary_edge().data< CommonEdgeData >().branch_length;
-    auto const proximal_length = base_node.primary_edge().data< CommonEdgeData >().branch_length;
-
-    // remove leaf from tree
-    delete_leaf_node( tree, leaf_node );
-
-    // track edge that will become the leftover edge in the pruned tree
-    CommonTreeEdge* attach_edge_ptr = &base_node.primary_edge();
-
-    // remove
-    delete_linear_node( tree, base_node, []( TreeEdge& r_edge, TreeEdge& d_edge ) {
-      r_edge.data< CommonEdgeData >().branch_length += d_edge.data< CommonEdgeData >().branch_length;
-    } );
-
-    // determine edge_num of edge where we pruned
-    size_t edge_num = 0;
-    for( auto const& it : postorder( tree ) ) {
-      if( it.is_last_iteration() ) {
+  auto leaf_ids = leaf_node_indices( ref.tree );
+  std::vector< std::string > errors( leaf_ids.size() );
+
+#pragma omp parallel for schedule( dynamic )
+  for( size_t i = 0; i < leaf_ids.size(); ++i ) {
+    try {
+      auto const id = leaf_ids[ i ];
+
+      // make an output dir for this leaf
+      auto cur_out_dir = dir_normalize_path( out_dir + std::to_string( id ) );
+      dir_create( cur_out_dir );
+
+      if( shared ) {
+        write_location( prune_leaf( ref, id, nullptr ), cur_out_dir + "original_location.csv" );
         continue;
       }
 
-      if( &it.edge() == attach_edge_ptr ) {
-        break;
-      } else {
-        edge_num++;
-      }
-    }
-    fail( edge_num >= edge_count( tree ), std::to_string( edge_num ) + " vs. " + std::to_string( edge_count( tree ) ) );
-    assert( edge_num < edge_count( tree ) );
-
-    // make an output dir for this leaf
-    auto cur_out_dir = dir_normalize_path( out_dir + std::to_string( id ) );
-    dir_create( cur_out_dir );
-
-    // write leaf name, edge_num, pendant and distal lengths
-    std::ofstream locfile( cur_out_dir + "original_location.csv" );
-    locfile << "name,edge_num,pendant,proximal\n";
-    locfile << leaf_name + ",";
-    locfile << std::to_string( edge_num ) + ",";
-    locfile << std::to_string( pendant_length ) + ",";
-    locfile << std::to_string( proximal_length ) + "\n";
-
-    // write the tree
-    CommonTreeNewickWriter().write( tree, to_file(cur_out_dir + "pruned.newick") );
-
-    // write the sequence, unaligned, into a phylip file
-    SequenceSet seq_set;
-    auto& seq = seq_set.add( *find_sequence( msa, leaf_name ) );
-    remove_all_gaps( seq );
-
-    PhylipWriter().write( seq_set, to_file(cur_out_dir + "query.phylip") );
-
-    // write out ref msa
-    SequenceSet ref_set( msa );
-    for( auto it = ref_set.begin(); it != ref_set.end(); ++it ) {
-      if( it->label() == leaf_name ) {
-        ref_set.remove( it );
-        break;
-      }
+      std::ofstream tree_out( cur_out_dir + "pruned.newick" );
+      auto const loc = prune_leaf( ref, id, &tree_out );
+      tree_out.close();
+      fail( not tree_out, "Cannot write " + cur_out_dir + "pruned.newick" );
+
+      write_location( loc, cur_out_dir + "original_location.csv" );
+      write_query( ref, loc.name, cur_out_dir + "query.phylip" );
+      write_reference( ref, loc.name, cur_out_dir + "reference.phylip" );
+    } catch( std::exception const& e ) {
+      errors[ i ] = e.what();
     }
+  }
 
-    PhylipWriter().write( ref_set, to_file(cur_out_dir + "reference.phylip") );
+  for( auto const& error : errors ) {
+    fail( not error.empty(), error );
   }
 
   return 0;
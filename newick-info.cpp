@@ -23,6 +23,7 @@
 #include "genesis/genesis.hpp"
 
 #include <string>
+#include <sstream>
 #include <vector>
 #include <algorithm>
 
@@ -38,6 +39,126 @@ void fail( bool const fail_if_true, std::string const& msg )
   }
 }
 
+struct TreeStats {
+  bool bifurcating = true;
+  bool rooted      = false;
+
+  size_t leafs = 0;
+  size_t inner = 0;
+  size_t edges = 0;
+
+  double length   = 0.0;
+  double height   = 0.0;
+  double diameter = 0.0;
+
+  // sum of the leaf depths, and sum of the leaf count differences of the two subtrees of every
+  // inner node, the latter only for rooted bifurcating trees
+  size_t sackin  = 0;
+  size_t colless = 0;
+};
+
+/**
+ * All the stats of a tree from a single postorder traversal, instead of one traversal per
+ * function. Every node gets its number of leafs below, its longest path down to a leaf, and the
+ * two longest paths down through different children, which meet in the longest path through it.
+ * The result is the same as from length(), height(), diameter(), is_bifurcating(), is_rooted()
+ * and the node counts.
+ */
+TreeStats tree_stats( Tree const& tree )
+{
+  TreeStats stats;
+
+  auto const node_count = tree.node_count();
+  std::vector< size_t > leafs( node_count, 0 );
+  std::vector< size_t > children( node_count, 0 );
+  std::vector< size_t > min_leafs( node_count, 0 );
+  std::vector< size_t > max_leafs( node_count, 0 );
+  std::vector< double > down( node_count, 0.0 );
+  std::vector< double > second_down( node_count, 0.0 );
+
+  for( auto it : postorder( tree ) ) {
+    auto const& node = it.node();
+    auto const i     = node.index();
+
+    if( is_leaf( node ) ) {
+      ++stats.leafs;
+      leafs[ i ] = 1;
+    } else {
+      ++stats.inner;
+      if( children[ i ] == 2 ) {
+        stats.colless += max_leafs[ i ] - min_leafs[ i ];
+      }
+    }
+    stats.diameter = std::max( stats.diameter, down[ i ] + second_down[ i ] );
+
+    if( it.is_last_iteration() ) {
+      auto const degree = children[ i ];
+      stats.rooted      = ( degree == 2 );
+      stats.bifurcating = stats.bifurcating and ( degree == 2 or degree == 3 );
+      stats.height      = down[ i ];
+      continue;
+    }
+
+    // every other node has its parent as one more neighbour
+    auto const degree = children[ i ] + 1;
+    stats.bifurcating = stats.bifurcating and ( degree == 1 or degree == 3 );
+
+    auto const parent = it.edge().primary_node().index();
+    auto const bl     = it.edge().data< CommonEdgeData >().branch_length;
+    ++stats.edges;
+    stats.length += bl;
+    stats.sackin += leafs[ i ];
+
+    leafs[ parent ] += leafs[ i ];
+    min_leafs[ parent ] = children[ parent ] ? std::min( min_leafs[ parent ], leafs[ i ] ) : leafs[ i ];
+    max_leafs[ parent ] = std::max( max_leafs[ parent ], leafs[ i ] );
+    ++children[ parent ];
+
+    auto const path = down[ i ] + bl;
+    if( path > down[ parent ] ) {
+      second_down[ parent ] = down[ parent ];
+      down[ parent ]        = path;
+    } else if( path > second_down[ parent ] ) {
+      second_down[ parent ] = path;
+    }
+  }
+
+  if( not( stats.rooted and stats.bifurcating ) ) {
+    stats.colless = 0;
+  }
+  return stats;
+}
+
+void print_stats( std::ostream& os, TreeStats const& stats, std::string const& indent )
+{
+  os << indent << "Tree is " << (stats.bifurcating ? "bifurcating"
+                                                   : "multifurcating") << "\n";
+  os << indent << "Tree is " << (stats.rooted ? "rooted"
+                                              : "unrooted") << "\n";
+  os << indent << "Topology numbers:" << "\n";
+  os << indent << "  leafs: " << std::to_string( stats.leafs ) << "\n";
+  os << indent << "  inner: " << std::to_string( stats.inner ) << "\n";
+  os << indent << "  edges: " << std::to_string( stats.edges ) << "\n";
+
+  os << indent << "Branch length stats, tree" << "\n";
+  os << indent << "  BL sum:   " << std::to_string( stats.length ) << "\n";
+  os << indent << "  BL avg:   " << std::to_string( stats.length / stats.edges ) << "\n";
+  os << indent << "  height:   " << std::to_string( stats.height ) << "\n";
+  os << indent << "  diameter: " << std::to_string( stats.diameter ) << "\n";
+
+  os << indent << "Balance indices" << "\n";
+  os << indent << "  Sackin:   " << std::to_string( stats.sackin ) << "\n";
+  os << indent << "  Colless:  " << ( stats.rooted and stats.bifurcating
+                                        ? std::to_string( stats.colless )
+                                        : std::string( "n/a (needs a rooted bifurcating tree)" ) ) << "\n";
+}
+
+/**
+ * Prints topology, branch length and balance stats of all trees in the given newick files, which
+ * may hold more than one tree each, followed by the averages over all trees.
+ *
+ * Several files are processed in parallel; the trees of a single file are, too.
+ */
 int main( int argc, char** argv )
 {
   // Check if the command line contains the right number of arguments.
@@ -49,47 +170,68 @@ int main( int argc, char** argv )
   Options::get().allow_file_overwriting( true );
   Logging::log_to_stdout();
 
-  size_t const num_trees = argc - 1;
+  std::vector< std::string > tree_files( argv + 1, argv + argc );
+
+  size_t num_trees = 0;
 
   double allsum_blavg = 0.0;
   double allsum_blsum = 0.0;
   double allsum_diam  = 0.0;
   double allsum_heigh = 0.0;
 
-  for( int i = 1; i < argc; ++i ) {
-    std::string tree_file( argv[ i ] );
-
-    auto tree = CommonTreeNewickReader().read( from_file( tree_file ) );
-
-    std::cout << "File: " << tree_file << "\n";
-    std::cout << "  Tree is " << (is_bifurcating( tree ) ? "bifurcating" 
-                                                        : "multifurcating") << "\n";
-    std::cout << "  Tree is " << (is_rooted( tree ) ? "rooted" 
-                                                   : "unrooted") << "\n";
-    std::cout << "  Topology numbers:" << "\n";
-    std::cout << "    leafs: " << std::to_string( leaf_node_count( tree ) ) << "\n";
-    std::cout << "    inner: " << std::to_string( inner_node_count( tree ) ) << "\n";
-    std::cout << "    edges: " << std::to_string( edge_count( tree ) ) << "\n";
-
-    std::cout << "  Branch length stats, tree" << "\n";
-    double blsum = length( tree );
-    std::cout << "    BL sum:   " << std::to_string( blsum ) << "\n";
-    double blavg = blsum / edge_count( tree );
-    std::cout << "    BL avg:   " << std::to_string( blavg ) << "\n";
-    double heigh = height( tree );
-    std::cout << "    height:   " << std::to_string( heigh ) << "\n";
-    double diam = diameter( tree );
-    std::cout << "    diameter: " << std::to_string( diam ) << "\n";
-
-    allsum_blavg += blavg;
-    allsum_blsum += blsum;
-    allsum_diam  += diam;
-    allsum_heigh += heigh;
+  std::vector< std::string > errors( tree_files.size() );
+
+  // with a single file, this loop is not parallel, so that the loop over its trees is
+#pragma omp parallel for schedule( dynamic ) ordered if( tree_files.size() > 1 )
+  for( size_t f = 0; f < tree_files.size(); ++f ) {
+    auto const& tree_file = tree_files[ f ];
+
+    TreeSet trees;
+    std::vector< TreeStats > stats;
+    try {
+      CommonTreeNewickReader().read( from_file( tree_file ), trees );
+      stats.resize( trees.size() );
+    } catch( std::exception const& e ) {
+      errors[ f ] = tree_file + ": " + e.what();
+    }
+
+#pragma omp parallel for schedule( dynamic )
+    for( size_t t = 0; t < trees.size(); ++t ) {
+      stats[ t ] = tree_stats( trees.at( t ) );
+    }
+
+    std::ostringstream out;
+    out << "File: " << tree_file << "\n";
+    for( size_t t = 0; t < stats.size(); ++t ) {
+      if( stats.size() == 1 ) {
+        print_stats( out, stats[ t ], "  " );
+      } else {
+        auto const& name = trees.name_at( t );
+        out << "  Tree " << ( name.empty() ? std::to_string( t ) : name ) << ":\n";
+        print_stats( out, stats[ t ], "    " );
+      }
+    }
+
+#pragma omp ordered
+    {
+      std::cout << out.str();
+      for( auto const& s : stats ) {
+        allsum_blavg += s.length / s.edges;
+        allsum_blsum += s.length;
+        allsum_diam  += s.diameter;
+        allsum_heigh += s.height;
+      }
+      num_trees += stats.size();
+    }
+  }
+
+  for( auto const& error : errors ) {
+    fail( not error.empty(), error );
   }
 
   std::cout << "\n";
 
-  std::cout << "Averages over all trees:" << "\n";
+  std::cout << "Averages over all " << std::to_string( num_trees ) << " trees:" << "\n";
   std::cout << "  BL sum:   " << std::to_string( allsum_blsum / num_trees ) << "\n";
   std::cout << "  BL avg:   " << std::to_string( allsum_blavg / num_trees ) << "\n";
   std::cout << "  height:   " << std::to_string( allsum_heigh / num_trees ) << "\n";
@@ -0,0 +1,219 @@
+/*
+    Copyright (C) 2026 agent <agent@local>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "genesis/genesis.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace genesis;
+using namespace genesis::tree;
+using namespace genesis::utils;
+
+void fail( bool const fail_if_true, std::string const& msg )
+{
+  if( fail_if_true ) {
+    throw std::runtime_error{ msg };
+  }
+}
+
+/**
+ * Random 64 bit label per taxon, after Pattengale et al. The label of a split is the XOR of the
+ * labels of the taxa on one side, so that it comes from a single postorder pass, in the size of a
+ * word instead of one bit per taxon. Collisions of two different splits are possible, but at 64
+ * bit too unlikely to matter for RF distances.
+ */
+struct SplitHasher {
+  std::unordered_map< std::string, size_t > leaf_ids;
+  std::vector< uint64_t > leaf_hashes;
+  uint64_t all_leafs = 0;
+
+  explicit SplitHasher( Tree const& tree )
+  {
+    // fixed seed and sorted names, so that the labels do not depend on the run or the leaf order
+    auto names = node_names( tree, true );
+    std::sort( names.begin(), names.end() );
+    std::mt19937_64 engine( 42 );
+    for( auto const& name : names ) {
+      auto const hash = engine();
+      fail( not leaf_ids.emplace( name, leaf_hashes.size() ).second, "Duplicate taxon name: " + name );
+      leaf_hashes.push_back( hash );
+      all_leafs ^= hash;
+    }
+  }
+
+  /**
+   * Sorted hashes of the non-trivial splits of a tree. Each split is stored in a canonical
+   * orientation, the smaller of the hashes of its two sides, so that rooting does not matter.
+   */
+  std::vector< uint64_t > operator()( Tree const& tree ) const
+  {
+    std::vector< uint64_t > below( tree.node_count(), 0 );
+    std::vector< size_t > below_leafs( tree.node_count(), 0 );
+    std::vector< uint64_t > splits;
+    splits.reserve( tree.edge_count() );
+    // every taxon exactly once, as two copies of a taxon would cancel out in the XOR
+    std::vector< char > seen( leaf_hashes.size(), false );
+    size_t leafs = 0;
+
+    for( auto it : postorder( tree ) ) {
+      auto const& node = it.node();
+      auto const i     = node.index();
+
+      if( is_leaf( node ) ) {
+        auto const& name = node.data< CommonNodeData >().name;
+        auto const id    = leaf_ids.find( name );
+        fail( id == leaf_ids.end(), "Taxon not in the first tree: " + name );
+        fail( seen[ id->second ], "Duplicate taxon name: " + name );
+        seen[ id->second ] = true;
+        below[ i ] ^= leaf_hashes[ id->second ];
+        below_leafs[ i ] = 1;
+        ++leafs;
+      } else if( not it.is_last_iteration()
+                 and below_leafs[ i ] > 1 and below_leafs[ i ] + 1 < leaf_hashes.size() ) {
+        // skipping the inner edges that still separate a single taxon, as at a root next to a leaf
+        splits.push_back( std::min( below[ i ], below[ i ] ^ all_leafs ) );
+      }
+
+      if( not it.is_last_iteration() ) {
+        below[ it.edge().primary_node().index() ] ^= below[ i ];
+        below_leafs[ it.edge().primary_node().index() ] += below_leafs[ i ];
+      }
+    }
+    fail( leafs != leaf_hashes.size(), "Trees do not have the same number of taxa." );
+
+    // the two edges at the root of a rooted tree are the same split
+    std::sort( splits.begin(), splits.end() );
+    splits.erase( std::unique( splits.begin(), splits.end() ), splits.end() );
+    return splits;
+  }
+};
+
+size_t shared_splits( std::vector< uint64_t > const& lhs, std::vector< uint64_t > const& rhs )
+{
+  size_t shared = 0;
+  auto l        = lhs.begin();
+  auto r        = rhs.begin();
+  while( l != lhs.end() and r != rhs.end() ) {
+    if( *l < *r ) {
+      ++l;
+    } else if( *r < *l ) {
+      ++r;
+    } else {
+      ++shared;
+      ++l;
+      ++r;
+    }
+  }
+  return shared;
+}
+
+/**
+ *  Outputs the pairwise Robinson-Foulds distance matrix of all trees in the given newick files,
+ *  which must all have the same taxa. With --relative, each distance is divided by the number of
+ *  non-trivial splits of both trees.
+ */
+int main( int argc, char** argv )
+{
+  std::string const usage = std::string( "Usage: " ) + argv[ 0 ] + " [--relative] <newick>...\n";
+
+  bool relative = false;
+
+  int arg = 1;
+  for( ; arg < argc and std::string( argv[ arg ] ).substr( 0, 2 ) == "--"; ++arg ) {
+    std::string const opt( argv[ arg ] );
+    if( opt == "--relative" ) {
+      relative = true;
+    } else {
+      throw std::runtime_error( "Unknown option: " + opt + "\n" + usage );
+    }
+  }
+
+  // Check if the command line contains the right number of arguments.
+  if( argc - arg < 1 ) {
+    throw std::runtime_error( usage );
+  }
+
+  // only the split hashes are kept, the trees of a file are dropped once they are hashed
+  std::unique_ptr< SplitHasher > hasher;
+  std::vector< std::vector< uint64_t > > splits;
+  std::vector< std::string > names;
+
+  for( int f = arg; f < argc; ++f ) {
+    std::string const tree_file( argv[ f ] );
+
+    TreeSet trees;
+    CommonTreeNewickReader().read( from_file( tree_file ), trees );
+
+    if( not hasher and not trees.empty() ) {
+      hasher.reset( new SplitHasher( trees.at( 0 ) ) );
+    }
+
+    auto const offset = splits.size();
+    splits.resize( offset + trees.size() );
+    std::vector< std::string > errors( trees.size() );
+
+#pragma omp parallel for schedule( dynamic )
+    for( size_t t = 0; t < trees.size(); ++t ) {
+      try {
+        splits[ offset + t ] = ( *hasher )( trees.at( t ) );
+      } catch( std::exception const& e ) {
+        errors[ t ] = tree_file + ", tree " + std::to_string( t ) + ": " + e.what();
+      }
+    }
+
+    for( size_t t = 0; t < trees.size(); ++t ) {
+      fail( not errors[ t ].empty(), errors[ t ] );
+      auto const& name = trees.name_at( t );
+      if( not name.empty() ) {
+        names.push_back( name );
+      } else if( trees.size() == 1 ) {
+        names.push_back( tree_file );
+      } else {
+        names.push_back( tree_file + ":" + std::to_string( t ) );
+      }
+    }
+  }
+
+  size_t const n = splits.size();
+  fail( n == 0, "No trees found." );
+
+  // rows of the upper triangle, which get shorter towards the end, hence the dynamic schedule
+  Matrix< double > rf_matrix( n, n, 0.0 );
+#pragma omp parallel for schedule( dynamic )
+  for( size_t i = 0; i < n; ++i ) {
+    for( size_t j = i + 1; j < n; ++j ) {
+      auto const total = splits[ i ].size() + splits[ j ].size();
+      double rf        = total - 2 * shared_splits( splits[ i ], splits[ j ] );
+      if( relative and total > 0 ) {
+        rf /= total;
+      }
+      rf_matrix.at( i, j ) = rf_matrix.at( j, i ) = rf;
+    }
+  }
+
+  MatrixWriter< double >().write( rf_matrix, to_stream( std::cout ), {}, names );
+
+  return 0;
+}
@@ -22,10 +22,22 @@
 
 #include "genesis/genesis.hpp"
 
+#include "rooting-common.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <istream>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <regex>
 
+#ifdef GENESIS_OPENMP
+#include <omp.h>
+#endif
+
 using namespace genesis;
 using namespace genesis::sequence;
 using namespace genesis::tree;
@@ -38,17 +50,51 @@ void fail( bool const fail_if_true, std::string const& msg )
   }
 }
 
-std::vector<TreeNode const*> nodes_by_pattern( Tree const& tree, std::string const& pattern )
+/**
+ * Matches leaf names against the rooting pattern, remembering the result for every name seen
+ * before. Bootstrap and replicate trees share their taxa, so after the first tree no name ever
+ * needs to be searched again. Not thread safe, so there is one per thread.
+ */
+class LabelMatcher
+{
+public:
+  explicit LabelMatcher( std::string const& pattern )
+      : reg_( pattern )
+  {
+  }
+
+  /**
+   * Matched part of the name, or an empty string if it does not match.
+   */
+  std::string const& match( std::string const& name )
+  {
+    auto it = cache_.find( name );
+    if( it == cache_.end() ) {
+      std::smatch match;
+      std::string matched;
+      if( std::regex_search( name, match, reg_ ) ) {
+        matched = match.str();
+      }
+      it = cache_.emplace( name, std::move( matched ) ).first;
+    }
+    return it->second;
+  }
+
+private:
+  std::regex reg_;
+  std::unordered_map< std::string, std::string > cache_;
+};
+
+std::vector<TreeNode const*> nodes_by_pattern( Tree const& tree, LabelMatcher& matcher )
 {
   auto names = node_names( tree, true );
-  std::regex reg( pattern );
 
   std::vector< std::string > root_names;
 
   for( auto const& name : names ) {
-    std::smatch match;
-    if( std::regex_search(  name, match, reg ) ) {
-      root_names.push_back( match.str() );
+    auto const& matched = matcher.match( name );
+    if( not matched.empty() ) {
+      root_names.push_back( matched );
     }
   }
 
@@ -56,22 +102,42 @@ std::vector<TreeNode const*> nodes_by_pattern( Tree const& tree, std::string con
 }
 
 /**
- * LCA of given nodes
+ * Reads the text of the next tree, up to and including its terminating semicolon, skipping quoted
+ * labels and comments. Returns false once there is no further tree in the stream.
  */
-TreeEdge& lowest_common_ancestor( Tree& tree, std::vector<TreeNode const*>& nodes )
+bool read_newick( std::istream& in, std::string& newick )
 {
-    assert( not nodes.empty() );
-
-    auto bipart = find_smallest_subtree( tree, bipartition_set( tree ), nodes );
-
-    if ( bipart.empty() ) {
-        throw std::invalid_argument{"Rooting could not be determined."};
+  newick.clear();
+  char quote   = 0;
+  bool comment = false;
+  char c;
+  while( in.get( c ) ) {
+    if( newick.empty() and std::isspace( static_cast< unsigned char >( c ) ) ) {
+      continue;
     }
-
-    return const_cast<TreeEdge&>( bipart.link().edge() );
-
+    newick += c;
+    if( quote ) {
+      quote = ( c == quote ) ? 0 : quote;
+    } else if( comment ) {
+      comment = ( c != ']' );
+    } else if( c == '\'' or c == '"' ) {
+      quote = c;
+    } else if( c == '[' ) {
+      comment = true;
+    } else if( c == ';' ) {
+      return true;
+    }
+  }
+  fail( not newick.empty(), "Unterminated tree at the end of the input." );
+  return false;
 }
 
+/**
+ * Roots all trees of a newick file on the LCA of the leaves whose names match the given regex.
+ *
+ * The file is streamed in batches of trees: each batch is rooted in parallel and written in input
+ * order, so that only one batch is ever held in memory.
+ */
 int main( int argc, char** argv )
 {
   // Check if the command line contains the right number of arguments.
@@ -83,23 +149,61 @@ int main( int argc, char** argv )
   std::string tree_file( argv[ 1 ] );
   std::string root_pattern( argv[ 2 ] );
 
-  TreeSet trees;
+  std::ifstream in( tree_file );
+  fail( not in, "Cannot open file: " + tree_file );
+
+  auto const num_threads = std::max< size_t >( Options::get().number_of_threads(), 1 );
+  auto const batch_size  = 64 * num_threads;
+
+  std::vector< LabelMatcher > matchers( num_threads, LabelMatcher( root_pattern ) );
 
-  CommonTreeNewickReader().read( from_file( tree_file ), trees );
+  auto writer = CommonTreeNewickWriter();
+  writer.branch_length_precision(15);
 
-  for( auto& tree : trees ) {
-    // search for the leafs
-    auto nodes = nodes_by_pattern( tree, root_pattern );
-    // get lowest common ancestor edge of all found leafs
-    auto& lca_branch = lowest_common_ancestor( tree, nodes );
-    // root the tree there
-    make_rooted( tree, lca_branch );
+  std::vector< std::string > batch;
+  size_t first_tree = 0;
+  bool more         = true;
+  while( more ) {
+    batch.clear();
+    std::string newick;
+    while( batch.size() < batch_size and ( more = read_newick( in, newick ) ) ) {
+      batch.push_back( std::move( newick ) );
+    }
 
-    auto writer = CommonTreeNewickWriter();
-    writer.branch_length_precision(15);
+    std::vector< std::string > errors( batch.size() );
+
+#pragma omp parallel for schedule( dynamic ) ordered num_threads( num_threads )
+    for( size_t i = 0; i < batch.size(); ++i ) {
+#ifdef GENESIS_OPENMP
+      size_t const t = omp_get_thread_num();
+#else
+      size_t const t = 0;
+#endif
+      std::string out;
+      try {
+        auto tree = CommonTreeNewickReader().read( from_string( batch[ i ] ) );
+        // search for the leafs
+        auto nodes = nodes_by_pattern( tree, matchers[ t ] );
+        // get lowest common ancestor edge of all found leafs
+        auto& lca_branch = lowest_common_ancestor( tree, nodes );
+        // root the tree there
+        make_rooted( tree, lca_branch );
+
+        writer.write( tree, to_string( out ) );
+      } catch( std::exception const& e ) {
+        errors[ i ] = "Tree " + std::to_string( first_tree + i ) + ": " + e.what();
+      }
+
+#pragma omp ordered
+      {
+        std::cout << out;
+      }
+    }
 
-    writer.write( tree, to_stream( std::cout ) );
-    // std::cout << std::endl;
+    for( auto const& error : errors ) {
+      fail( not error.empty(), error );
+    }
+    first_tree += batch.size();
   }
 
   return 0;
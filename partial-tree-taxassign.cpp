@@ -22,7 +22,13 @@
 
 #include "genesis/genesis.hpp"
 
+#include "rooting-common.hpp"
+#include "taxonomy-common.hpp"
+
+#include <algorithm>
+#include <sstream>
 #include <string>
+#include <vector>
 
 using namespace genesis;
 using namespace genesis::sequence;
@@ -30,137 +36,48 @@ using namespace genesis::tree;
 using namespace genesis::utils;
 using namespace genesis::taxonomy;
 
-constexpr char UNDETERMINED[] = "N/A";
-constexpr char QUERY[]        = "query";
-
 void print_labelled( Tree const& tree,
-                     std::vector< Taxopath > const& node_labels )
+                     TaxonomyTrie const& trie,
+                     std::vector< size_t > const& node_labels )
 {
   CommonTreeNewickWriter writer;
   writer.node_to_element_plugins.push_back(
       [&]( TreeNode const& node, NewickBrokerElement& element ) {
         element.comments.emplace_back(
-            TaxopathGenerator().to_string( node_labels[ node.index() ] ) );
+            trie.to_string( node_labels[ node.index() ] ) );
       } );
   writer.write( tree, to_stream( std::cout ) );
 }
 
-Taxopath intersect( Taxopath const& lhs, Taxopath const& rhs )
-{
-  Taxopath result;
-
-  // short-circuit if one is coming from a label: in that case ignore the query label
-  if( lhs.size() and lhs[ 0 ] == QUERY ) {
-    return rhs;
-  }
-  if( rhs.size() and rhs[ 0 ] == QUERY ) {
-    return lhs;
-  }
-
-  // normal assignment if not
-  for( size_t i = 0; ( i < std::min( lhs.size(), rhs.size() ) ) and ( lhs[ i ] == rhs[ i ] ); ++i ) {
-    result.push_back( lhs[ i ] );
-  }
-
-  if( result.empty() ) {
-    result.push_back( UNDETERMINED );
-  }
-
-  return result;
-}
-
-std::vector< Taxopath > label_nodes( Tree const& tree,
-                                     std::string const& taxon_file )
-{
-  TaxopathParser tpp;
-  CsvReader csv_reader;
-  csv_reader.separator_chars( "\t" );
-  std::vector< Taxopath > node_labels( tree.node_count(), Taxopath( { QUERY } ) );
-
-  utils::InputStream it( utils::make_unique< utils::FileInputSource >( taxon_file ) );
-  while( it ) {
-    auto fields = csv_reader.parse_line( it );
-
-    if( fields.size() != 2 ) {
-      throw std::runtime_error{ "A line in the taxon file didn't have two tab separated columns." };
-    }
-
-    auto name              = fields[ 0 ];
-    std::string tax_string = fields[ 1 ];
-
-    auto node_ptr = find_node( tree, name );
-
-    if( node_ptr == nullptr ) {
-      throw std::runtime_error{ "Could not find node with name: " + name };
-    }
-
-    node_labels[ node_ptr->index() ] = tpp.parse( tax_string );
-  }
-
-  // check if any leafs weren't assigned a Taxopath
-  // for ( auto const& node_it : tree.nodes() ) {
-  //     if ( node_it->is_leaf() and node_labels[ node_it->index() ].empty() ) {
-  //         auto name = node_it->data< CommonNodeData >().name;
-  //         throw std::runtime_error{"The leaf in the tree labelled '" + name
-  //             + "' wasn't assigned a taxonomic path. Did you forget to include it in the taxon file?"};
-  //     }
-  // }
-  // go through the tree in postorder fashion and label inner nodes according to the most common taxonomic rank of the children
-  for( auto it : postorder( tree ) ) {
-    if( is_inner( it.node() ) ) {
-      auto const child_1_idx = it.node().link().next().outer().node().index();
-      auto const child_2_idx = it.node().link().next().next().outer().node().index();
-
-      assert( not node_labels[ child_1_idx ].empty() );
-
-      node_labels[ it.node().index() ] = intersect( node_labels[ child_1_idx ], node_labels[ child_2_idx ] );
-    }
-  }
-
-  return node_labels;
-}
 
 void print_query_taxassign( std::ostream& stream,
                             Tree const& tree,
-                            std::vector< Taxopath >& node_labels )
+                            TaxonomyTrie const& trie,
+                            std::vector< size_t >& node_labels,
+                            std::string const& prefix = "" )
 {
-  // find a tip node that is labeled as the root point of the traversal
-  TreeNode const* tmp_root = nullptr;
-  // also get all the query tip node indices for later already
+  // get all the query tip node indices before they get labelled
   std::vector< size_t > query_tip_indices;
   for( auto const i : leaf_node_indices( tree ) ) {
-    if( node_labels[ i ][ 0 ] != QUERY ) {
-      if( not tmp_root ) {
-        tmp_root = &tree.node_at( i );
-      }
-    } else {
+    if( node_labels[ i ] == TaxonomyTrie::QUERY_ID ) {
       query_tip_indices.push_back( i );
     }
   }
 
-  if( tmp_root == nullptr ) {
-    throw std::runtime_error{ "None of the tips had labels!" };
-  }
+  propagate_labels( tree, node_labels );
 
-  // label all inner nodes via pre-order traversal
-  TreeNode const* previous = tmp_root; // should work in our case?
-  for( auto it : tree::preorder( *tmp_root ) ) {
-    size_t i = it.node().index();
-    if( node_labels[ i ][ 0 ] == QUERY ) {
-      // need to label according to parent!
-      node_labels[ i ] = node_labels[ previous->index() ];
-    }
+  // format the query labels in parallel, then print them in order
+  std::vector< std::string > lines( query_tip_indices.size() );
 
-    previous = &it.node();
+#pragma omp parallel for schedule( static )
+  for( size_t k = 0; k < query_tip_indices.size(); ++k ) {
+    auto const i = query_tip_indices[ k ];
+    // output sativa-style taxassign
+    lines[ k ] = prefix + tree.node_at( i ).data< CommonNodeData >().name + "\t" + trie.to_string( node_labels[ i ] ) + "\n";
   }
 
-  // print all the query labels
-  for( auto const i : query_tip_indices ) {
-    // output sativa-style taxassign
-    stream << tree.node_at( i ).data< CommonNodeData >().name;
-    stream << "\t" << TaxopathGenerator().to_string( node_labels[ i ] );
-    // stream << "\t" << join( confidences, ";" );
-    stream << "\n";
+  for( auto const& line : lines ) {
+    stream << line;
   }
 }
 
@@ -174,19 +91,6 @@ std::vector< std::string > read_lines( std::string const& file_name )
   return lines;
 }
 
-TreeEdge* lowest_common_ancestor( Tree& tree, std::vector< TreeNode const* >& nodes )
-{
-  assert( not nodes.empty() );
-
-  auto bipart = find_smallest_subtree( tree, bipartition_set( tree ), nodes );
-
-  if( bipart.empty() ) {
-    throw std::invalid_argument{ "Rooting could not be determined." };
-  }
-
-  return const_cast< TreeEdge* >( &bipart.link().edge() );
-}
-
 void outgroup_rooting( Tree& tree,
                        std::vector< std::string > const& outgroup_names )
 {
@@ -212,7 +116,7 @@ void outgroup_rooting( Tree& tree,
   } else if( nodes.size() == 1 ) {
     edge_ptr = const_cast< TreeEdge* >( &( nodes[ 0 ]->primary_link().edge() ) );
   } else {
-    edge_ptr = lowest_common_ancestor( tree, nodes );
+    edge_ptr = &lowest_common_ancestor( tree, nodes );
   }
 
   assert( edge_ptr );
@@ -225,33 +129,108 @@ void outgroup_rooting( Tree& tree,
  * Takes a tree and a taxonomy file, which does only label a subset of the Trees taxa taxonomically.
  * Applies taxonomic labelling based on this partially labelled tree to the unlabelled queries, and prints
  * this information in tab-separated form to stdout
+ *
+ * With --batch, takes a file of many newick trees, or a directory of tree files, instead. The taxonomy
+ * is parsed once, the trees are labelled in parallel, and every output line starts with the tree id.
  */
 int main( int argc, char** argv )
 {
+  std::string const usage = std::string( "Usage: " ) + argv[ 0 ]
+                            + " [--batch] <tree_file|tree_dir> <taxonomy_file> [<outgroup_file>]";
+
+  bool batch = false;
+
+  int arg = 1;
+  for( ; arg < argc and std::string( argv[ arg ] ).substr( 0, 2 ) == "--"; ++arg ) {
+    std::string const opt( argv[ arg ] );
+    if( opt == "--batch" ) {
+      batch = true;
+    } else {
+      throw std::runtime_error( "Unknown option: " + opt + "\n" + usage );
+    }
+  }
+
   // Check if the command line contains the right number of arguments.
-  if( argc < 3 or argc > 4 ) {
-    throw std::runtime_error(
-        std::string( "Usage: " ) + argv[ 0 ] + " <tree_file> <taxonomy_file> [<outgroup_file>]" );
+  if( argc - arg < 2 or argc - arg > 3 ) {
+    throw std::runtime_error( usage );
   }
 
-  std::string tree_file( argv[ 1 ] );
-  std::string taxon_file( argv[ 2 ] );
+  std::string tree_file( argv[ arg ] );
+  std::string taxon_file( argv[ arg + 1 ] );
 
-  auto tree = CommonTreeNewickReader().read( from_file( tree_file ) );
+  std::vector< std::string > outgroup;
+  if( argc - arg == 3 ) {
+    outgroup = read_lines( argv[ arg + 2 ] );
+  }
+
+  auto const taxonomy = read_taxonomy( taxon_file );
 
-  if( argc == 4 ) {
-    if( is_rooted( tree ) ) {
-      throw std::invalid_argument{ "Trying to root an already rooted tree." };
+  if( not batch ) {
+    auto tree = CommonTreeNewickReader().read( from_file( tree_file ) );
+
+    if( not outgroup.empty() ) {
+      if( is_rooted( tree ) ) {
+        throw std::invalid_argument{ "Trying to root an already rooted tree." };
+      }
+      outgroup_rooting( tree, outgroup );
     }
-    std::string outgroup_file( argv[ 3 ] );
-    outgroup_rooting( tree, read_lines( outgroup_file ) );
+
+    auto node_labels = label_nodes( tree, taxonomy );
+
+    print_query_taxassign( std::cout, tree, taxonomy.trie, node_labels );
+
+    // print_labelled(tree, taxonomy.trie, node_labels);
+
+    return 0;
   }
 
-  auto node_labels = label_nodes( tree, taxon_file );
+  // read all trees, either from one file, or from all files of a directory
+  TreeSet trees;
+  if( is_dir( tree_file ) ) {
+    auto const dir = dir_normalize_path( tree_file );
+    auto files     = dir_list_files( dir );
+    std::sort( files.begin(), files.end() );
+    for( auto const& file : files ) {
+      CommonTreeNewickReader().read( from_file( dir + file ), trees );
+    }
+  } else {
+    CommonTreeNewickReader().read( from_file( tree_file ), trees );
+  }
 
-  print_query_taxassign( std::cout, tree, node_labels );
+  std::vector< std::string > errors( trees.size() );
 
-  // print_labelled(tree, node_labels);
+  // label the trees in parallel, but write their results in order
+#pragma omp parallel for schedule( dynamic ) ordered
+  for( size_t t = 0; t < trees.size(); ++t ) {
+    auto const tree_id = trees.name_at( t ).empty() ? std::to_string( t ) : trees.name_at( t );
+    std::ostringstream out;
+    try {
+      auto& tree = trees.at( t );
+
+      if( not outgroup.empty() ) {
+        if( is_rooted( tree ) ) {
+          throw std::invalid_argument{ "Trying to root an already rooted tree." };
+        }
+        outgroup_rooting( tree, outgroup );
+      }
+
+      auto node_labels = label_nodes( tree, taxonomy );
+      print_query_taxassign( out, tree, taxonomy.trie, node_labels, tree_id + "\t" );
+    } catch( std::exception const& e ) {
+      errors[ t ] = "Tree " + tree_id + ": " + e.what();
+    }
+
+#pragma omp ordered
+    {
+      std::cout << out.str();
+    }
+  }
+
+  for( auto const& error : errors ) {
+    if( not error.empty() ) {
+      throw std::runtime_error( error );
+    }
+  }
 
   return 0;
 }
@@ -22,17 +22,250 @@
 
 #include "genesis/genesis.hpp"
 
+#include "jplace-common.hpp"
+
 #include <algorithm>
+#include <cstdlib>
 #include <fstream>
+#include <sstream>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#ifdef GENESIS_OPENMP
+#include <omp.h>
+#endif
 
 using namespace genesis;
 using namespace genesis::placement;
 using namespace genesis::tree;
 using namespace genesis::utils;
 
+// -------------------------------------------------------------------------
+//     Sparse OTU table
+// -------------------------------------------------------------------------
+
+/**
+ * OTU table in compressed sparse row form: only the non-zero counts are stored,
+ * row r owning the entries row_begin[r] to row_begin[r+1].
+ */
+struct SparseOtuTable {
+  std::vector< std::string > sample_names;
+  std::vector< std::string > otu_names;
+  std::vector< size_t > row_begin = { 0 };
+  std::vector< size_t > columns;
+  std::vector< double > counts;
+
+  void add( size_t const column, double const count )
+  {
+    columns.push_back( column );
+    counts.push_back( count );
+  }
+
+  void end_row( std::string const& otu_name )
+  {
+    otu_names.push_back( otu_name );
+    row_begin.push_back( columns.size() );
+  }
+};
+
+/**
+ * Splits a line at tabs, without copying the fields.
+ */
+std::vector< std::pair< char const*, size_t > > split_fields( std::string const& line )
+{
+  std::vector< std::pair< char const*, size_t > > fields;
+  size_t begin = 0;
+  while( true ) {
+    auto const end = line.find( '\t', begin );
+    if( end == std::string::npos ) {
+      fields.emplace_back( line.data() + begin, line.size() - begin );
+      break;
+    }
+    fields.emplace_back( line.data() + begin, end - begin );
+    begin = end + 1;
+  }
+  return fields;
+}
+
+double parse_count( char const* str, size_t const len, std::string const& file )
+{
+  // fast path for the vast majority of cells
+  if( len == 1 and str[ 0 ] == '0' ) {
+    return 0.0;
+  }
+  char* end;
+  auto const value = std::strtod( str, &end );
+  if( end == str or end != str + len ) {
+    throw std::runtime_error( "Invalid count \"" + std::string( str, len ) + "\" in OTU table " + file );
+  }
+  return value;
+}
+
+bool read_table_line( std::istream& is, std::string& line )
+{
+  while( std::getline( is, line ) ) {
+    if( not line.empty() and line.back() == '\r' ) {
+      line.pop_back();
+    }
+    if( not line.empty() and line[ 0 ] != '#' ) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Tab separated OTU table with a header line of sample names, one row per OTU, and
+ * the OTU id in the first column. The last column is not a sample (e.g., the taxonomy).
+ */
+SparseOtuTable read_dense_otu_table( std::string const& file )
+{
+  SparseOtuTable table;
+  std::ifstream is( file );
+  if( not is ) {
+    throw std::runtime_error( "Cannot open OTU table: " + file );
+  }
+  std::string line;
+
+  if( not read_table_line( is, line ) ) {
+    throw std::runtime_error( "Empty OTU table: " + file );
+  }
+  auto const header = split_fields( line );
+  for( size_t col = 1; col + 1 < header.size(); ++col ) {
+    table.sample_names.emplace_back( header[ col ].first, header[ col ].second );
+  }
+
+  while( read_table_line( is, line ) ) {
+    auto const fields = split_fields( line );
+    for( size_t col = 1; col + 1 < fields.size() and col <= table.sample_names.size(); ++col ) {
+      auto const count = parse_count( fields[ col ].first, fields[ col ].second, file );
+      if( count > 0 ) {
+        table.add( col - 1, count );
+      }
+    }
+    table.end_row( std::string( fields[ 0 ].first, fields[ 0 ].second ) );
+  }
+
+  return table;
+}
+
+/**
+ * Triplet format: one line per non-zero count, as tab separated OTU id, sample name and count.
+ */
+SparseOtuTable read_triplet_otu_table( std::string const& file )
+{
+  std::unordered_map< std::string, size_t > otu_ids;
+  std::unordered_map< std::string, size_t > sample_ids;
+  std::vector< std::string > otu_names;
+  std::vector< std::tuple< size_t, size_t, double > > triplets;
+
+  std::ifstream is( file );
+  if( not is ) {
+    throw std::runtime_error( "Cannot open OTU table: " + file );
+  }
+  std::string line;
+  while( read_table_line( is, line ) ) {
+    auto const fields = split_fields( line );
+    if( fields.size() != 3 ) {
+      throw std::runtime_error( "A line in the triplet OTU table " + file + " does not have three columns." );
+    }
+    auto const count = parse_count( fields[ 2 ].first, fields[ 2 ].second, file );
+    if( not( count > 0 ) ) {
+      continue;
+    }
+    std::string const otu( fields[ 0 ].first, fields[ 0 ].second );
+    std::string const smp( fields[ 1 ].first, fields[ 1 ].second );
+
+    auto const otu_it = otu_ids.emplace( otu, otu_ids.size() );
+    if( otu_it.second ) {
+      otu_names.push_back( otu );
+    }
+    auto const smp_it = sample_ids.emplace( smp, sample_ids.size() );
+    triplets.emplace_back( otu_it.first->second, smp_it.first->second, count );
+  }
+
+  SparseOtuTable table;
+  table.sample_names.resize( sample_ids.size() );
+  for( auto const& smp : sample_ids ) {
+    table.sample_names[ smp.second ] = smp.first;
+  }
+
+  std::sort( triplets.begin(), triplets.end() );
+  size_t t = 0;
+  for( size_t row = 0; row < otu_names.size(); ++row ) {
+    for( ; t < triplets.size() and std::get< 0 >( triplets[ t ] ) == row; ++t ) {
+      table.add( std::get< 1 >( triplets[ t ] ), std::get< 2 >( triplets[ t ] ) );
+    }
+    table.end_row( otu_names[ row ] );
+  }
+
+  return table;
+}
+
+/**
+ * CSR format: a header line of tab separated sample names (the first field is ignored), then one
+ * line per OTU with its id followed by tab separated column:count pairs for its non-zero counts,
+ * with zero based column indices into the sample names.
+ */
+SparseOtuTable read_csr_otu_table( std::string const& file )
+{
+  SparseOtuTable table;
+  std::ifstream is( file );
+  if( not is ) {
+    throw std::runtime_error( "Cannot open OTU table: " + file );
+  }
+  std::string line;
+
+  if( not read_table_line( is, line ) ) {
+    throw std::runtime_error( "Empty OTU table: " + file );
+  }
+  auto const header = split_fields( line );
+  for( size_t col = 1; col < header.size(); ++col ) {
+    table.sample_names.emplace_back( header[ col ].first, header[ col ].second );
+  }
+
+  while( read_table_line( is, line ) ) {
+    auto const fields = split_fields( line );
+    for( size_t f = 1; f < fields.size(); ++f ) {
+      std::string const entry( fields[ f ].first, fields[ f ].second );
+      auto const colon = entry.find( ':' );
+      if( colon == std::string::npos ) {
+        throw std::runtime_error( "Invalid entry \"" + entry + "\" in CSR OTU table " + file );
+      }
+      if( colon == 0 or not std::all_of( entry.begin(), entry.begin() + colon, []( char c ) {
+            return c >= '0' and c <= '9';
+          } ) ) {
+        throw std::runtime_error( "Invalid entry \"" + entry + "\" in CSR OTU table " + file );
+      }
+      auto const col   = std::stoul( entry.substr( 0, colon ) );
+      auto const count = parse_count( entry.data() + colon + 1, entry.size() - colon - 1, file );
+      if( col >= table.sample_names.size() ) {
+        throw std::runtime_error( "Column index out of range in CSR OTU table " + file + ": " + entry );
+      }
+      if( count > 0 ) {
+        table.add( col, count );
+      }
+    }
+    table.end_row( std::string( fields[ 0 ].first, fields[ 0 ].second ) );
+  }
+
+  return table;
+}
+
 /**
- *  splits a jplace file into its constituent samples, based on a standard OTU table
+ * One non-zero cell of the OTU table: the pquery of the OTU, and its row in the table.
+ */
+struct SampleEntry {
+  size_t pquery;
+  size_t row;
+  double multiplicity;
+};
+
+/**
+ *  splits a jplace file into its constituent samples, based on a standard OTU table,
+ *  or a sparse one in triplet or CSR format
  */
 int main( int argc, char** argv )
 {
@@ -42,16 +275,44 @@ int main( int argc, char** argv )
 
   LOG_INFO << "Started";
 
+  std::string const usage = std::string( "Usage: " ) + argv[ 0 ]
+                            + " [--threads <n>] [--max-in-memory <samples>] [--format dense|triplet|csr] [--container]"
+                            + " <jplace-file> <otu-table> <out-path>\n";
+
+  // Options, which precede the positional arguments.
+  size_t num_threads   = utils::Options::get().number_of_threads();
+  size_t max_in_memory = num_threads;
+  std::string format( "dense" );
+  bool container       = false;
+
+  int arg = 1;
+  for( ; arg < argc and std::string( argv[ arg ] ).substr( 0, 2 ) == "--"; ++arg ) {
+    std::string const opt( argv[ arg ] );
+    if( opt == "--threads" and arg + 1 < argc ) {
+      num_threads = std::stoul( argv[ ++arg ] );
+    } else if( opt == "--max-in-memory" and arg + 1 < argc ) {
+      max_in_memory = std::stoul( argv[ ++arg ] );
+    } else if( opt == "--format" and arg + 1 < argc ) {
+      format = argv[ ++arg ];
+    } else if( opt == "--container" ) {
+      container = true;
+    } else {
+      throw std::runtime_error( "Unknown option: " + opt + "\n" + usage );
+    }
+  }
+
   // Check if the command line contains the right number of arguments.
-  if( argc != 4 ) {
-    throw std::runtime_error(
-        std::string( "Usage: " ) + argv[ 0 ] + " <jplace-file> <otu-table> <out-path>\n" );
+  if( argc - arg != 3 ) {
+    throw std::runtime_error( usage );
   }
 
+  // at most this many output samples are generated at the same time, each by its own worker
+  size_t const num_workers = std::max< size_t >( std::min( num_threads, max_in_memory ), 1 );
+
   // In out dirs.
-  auto jplacefile = std::string( argv[ 1 ] );
-  auto otufile    = std::string( argv[ 2 ] );
-  auto outdir     = utils::dir_normalize_path( std::string( argv[ 3 ] ) );
+  auto jplacefile = std::string( argv[ arg ] );
+  auto otufile    = std::string( argv[ arg + 1 ] );
+  auto outdir     = utils::dir_normalize_path( std::string( argv[ arg + 2 ] ) );
   utils::dir_create( outdir );
 
   // -------------------------------------------------------------------------
@@ -62,60 +323,157 @@ int main( int argc, char** argv )
 
   LOG_INFO << "Finished reading input jplace file: " << jplacefile;
 
-  CsvReader csvreader;
-
-  csvreader.separator_chars( "\t" );
-  csvreader.comment_chars( "#" );
-
-  auto table = csvreader.read( from_file( otufile ) );
-
-  LOG_INFO << "Finished reading OTU table: " << otufile;
-
-  auto& headers = table[ 0 ];
-  LOG_INFO << "Splitting into " << headers.size() - 1 << " separate sample files.";
-
-  auto writer = JplaceWriter();
-  // iterate over the OTU table, column major
-  for( size_t col = 1; col < table[ 0 ].size() - 1; ++col ) {
-    // create an output sample
-    auto sample_id = headers[ col ];
-    Sample out_sample( in_sample.tree() );
-
-    LOG_DBG << "Sample: " << sample_id;
-
-    for( size_t row = 1; row < table.size(); ++row ) {
-      // get the OTU-id
-      auto otu_id       = table[ row ][ 0 ];
-      auto multiplicity = std::stod( table[ row ][ col ] );
-
-      // only write if the otu was in the sample to begin with
-      if( multiplicity > 0 ) {
-        // look up the relevant PQuery
-        auto it = std::find_if( std::begin( in_sample ), std::end( in_sample ),
-                                [otu_id]( const Pquery& pq ) {
-                                  bool ret = false;
-                                  for( auto& name : pq.names() ) {
-                                    if( otu_id == name ) {
-                                      ret = true;
-                                    }
-                                  }
-                                  return ret;
-                                }
-
-        );
-
-        if( it != std::end( in_sample ) ) {
-          // add pquery to output sample including multiplicity count
-          auto& pq = out_sample.add( *it );
-          // we need to manually set name and multiplicity such that other names/multiplicities
-          // don't get copied over from the input sample
-          pq.clear_names();
-          pq.add_name( otu_id, multiplicity );
+  SparseOtuTable table;
+  if( format == "dense" ) {
+    table = read_dense_otu_table( otufile );
+  } else if( format == "triplet" ) {
+    table = read_triplet_otu_table( otufile );
+  } else if( format == "csr" ) {
+    table = read_csr_otu_table( otufile );
+  } else {
+    throw std::runtime_error( "Unknown OTU table format: " + format + "\n" + usage );
+  }
+
+  LOG_INFO << "Finished reading OTU table: " << otufile << " (" << table.otu_names.size() << " OTUs, "
+           << table.counts.size() << " non-zero counts)";
+
+  auto const& headers = table.sample_names;
+  LOG_INFO << "Splitting into " << headers.size() << " separate sample files.";
+
+  // index the pqueries by name once, instead of searching them for every table cell
+  std::unordered_map< std::string, size_t > pquery_index;
+  for( size_t i = 0; i < in_sample.size(); ++i ) {
+    for( auto const& name : in_sample.at( i ).names() ) {
+      pquery_index.emplace( name.name, i );
+    }
+  }
+
+  // traverse the non-zero counts of the OTU table once, row major, collecting for every
+  // sample the pqueries and multiplicities it contains
+  size_t const num_out = headers.size();
+  std::vector< std::vector< SampleEntry > > sample_entries( num_out );
+
+  size_t unknown_otus = 0;
+  for( size_t row = 0; row < table.otu_names.size(); ++row ) {
+    // get the OTU-id
+    auto const it = pquery_index.find( table.otu_names[ row ] );
+    if( it == pquery_index.end() ) {
+      ++unknown_otus;
+      continue;
+    }
+
+    for( size_t k = table.row_begin[ row ]; k < table.row_begin[ row + 1 ]; ++k ) {
+      sample_entries[ table.columns[ k ] ].push_back( { it->second, row, table.counts[ k ] } );
+    }
+  }
+
+  if( unknown_otus > 0 ) {
+    LOG_INFO << unknown_otus << " OTUs of the table have no pquery in the jplace file.";
+  }
+
+  // the reference tree is the same in every output file, so serialise it only once
+  auto const tree_string = JplaceStreamWriter::tree_string( in_sample.tree() );
+
+  if( container ) {
+    // write all samples into one file that stores every used pquery once, with its total
+    // multiplicity, and per sample only the indices and multiplicities of its pqueries
+    auto const out_file = outdir + "samples.jplace";
+    if( file_exists( out_file ) and not Options::get().allow_file_overwriting() ) {
+      throw std::runtime_error( "Output file already exists: " + out_file );
+    }
+
+    // one container entry per pquery, also when several OTUs of the table name the same one.
+    // it is written under the OTU name through which it was first reached.
+    std::vector< size_t > container_index( in_sample.size(), in_sample.size() );
+    std::vector< size_t > pqueries;
+    std::vector< size_t > rows;
+    std::vector< double > total_multiplicity;
+    std::vector< std::vector< std::pair< size_t, double > > > multiplicities( num_out );
+
+    // last sample that listed each entry, and where, so that its OTUs add up to one multiplicity
+    std::vector< size_t > last_sample;
+    std::vector< size_t > last_position;
+    for( size_t s = 0; s < num_out; ++s ) {
+      for( auto const& entry : sample_entries[ s ] ) {
+        if( container_index[ entry.pquery ] == in_sample.size() ) {
+          container_index[ entry.pquery ] = pqueries.size();
+          pqueries.push_back( entry.pquery );
+          rows.push_back( entry.row );
+          total_multiplicity.push_back( 0.0 );
+          last_sample.push_back( num_out );
+          last_position.push_back( 0 );
+        }
+        auto const index = container_index[ entry.pquery ];
+        total_multiplicity[ index ] += entry.multiplicity;
+        if( last_sample[ index ] == s ) {
+          multiplicities[ s ][ last_position[ index ] ].second += entry.multiplicity;
+        } else {
+          last_sample[ index ]   = s;
+          last_position[ index ] = multiplicities[ s ].size();
+          multiplicities[ s ].emplace_back( index, entry.multiplicity );
         }
       }
     }
 
-    writer.write( out_sample, to_file( outdir + sample_id + ".jplace" ) );
+    std::ofstream out( out_file );
+    if( not out ) {
+      throw std::runtime_error( "Cannot write " + out_file );
+    }
+    JplaceStreamWriter writer( out, tree_string );
+    for( size_t i = 0; i < pqueries.size(); ++i ) {
+      writer.write_pquery( in_sample.at( pqueries[ i ] ), table.otu_names[ rows[ i ] ], total_multiplicity[ i ] );
+    }
+    writer.add_field( "samples", sample_container_field( headers, multiplicities ) );
+    writer.finish();
+    out.close();
+    if( not out ) {
+      throw std::runtime_error( "Cannot write " + out_file );
+    }
+
+    LOG_INFO << "Wrote " << pqueries.size() << " pqueries of " << num_out << " samples to " << out_file;
+    LOG_INFO << "Finished";
+    return 0;
+  }
+
+  // check the output files up front, so that an existing file fails before any work is done
+  for( auto const& sample_id : headers ) {
+    auto const out_file = outdir + sample_id + ".jplace";
+    if( file_exists( out_file ) and not Options::get().allow_file_overwriting() ) {
+      throw std::runtime_error( "Output file already exists: " + out_file );
+    }
+  }
+
+  LOG_INFO << "Writing with " << num_workers << " workers";
+
+  std::vector< std::string > errors( num_out );
+
+#pragma omp parallel for schedule( dynamic ) num_threads( num_workers )
+  for( size_t s = 0; s < num_out; ++s ) {
+    auto const& sample_id = headers[ s ];
+
+    // generate the whole sample in memory, then write it out in one go
+    std::ostringstream buffer;
+    JplaceStreamWriter writer( buffer, tree_string );
+    for( auto const& entry : sample_entries[ s ] ) {
+      // write the pquery including multiplicity count, under the OTU name of the table only
+      // such that other names/multiplicities don't get copied over from the input sample
+      writer.write_pquery( in_sample.at( entry.pquery ), table.otu_names[ entry.row ], entry.multiplicity );
+    }
+    writer.finish();
+
+    auto const out_file = outdir + sample_id + ".jplace";
+    std::ofstream out( out_file );
+    out << buffer.str();
+    out.close();
+    if( not out ) {
+      errors[ s ] = "Cannot write " + out_file;
+    }
+  }
+
+  for( auto const& error : errors ) {
+    if( not error.empty() ) {
+      throw std::runtime_error( error );
+    }
   }
 
   LOG_INFO << "Finished";
@@ -22,15 +22,35 @@
 
 #include "genesis/genesis.hpp"
 
+#include "jplace-common.hpp"
+
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <fstream>
+#include <functional>
 #include <string>
+#include <utility>
+#include <vector>
+
+#ifdef GENESIS_OPENMP
+#include <omp.h>
+#endif
 
 using namespace genesis;
 using namespace genesis::placement;
 using namespace genesis::tree;
 using namespace genesis::utils;
 
+void fail( bool const fail_if_true, std::string const& msg )
+{
+  if( fail_if_true ) {
+    throw std::runtime_error{ msg };
+  }
+}
+
 void normalize( Sample& sample )
 {
   auto const total = total_multiplicity( sample );
@@ -44,37 +64,482 @@ void normalize( Sample& sample )
                  } );
 }
 
+// -------------------------------------------------------------------------
+//     Mass profiles
+// -------------------------------------------------------------------------
+
+/**
+ * One entry per edge of the reference tree in postorder, pointing from the
+ * lower to the upper node. The root is not part of the sequence.
+ */
+struct TopologyEdge {
+  size_t edge_index;
+  size_t lower_node;
+  size_t upper_node;
+  double branch_length;
+};
+
+std::vector< TopologyEdge > postorder_edges( PlacementTree const& tree )
+{
+  std::vector< TopologyEdge > result;
+  result.reserve( tree.edge_count() );
+  for( auto it : postorder( tree ) ) {
+    if( it.is_last_iteration() ) {
+      continue;
+    }
+    auto const& edge = it.edge();
+    result.push_back( { edge.index(),
+                        it.node().index(),
+                        edge.primary_node().index(),
+                        edge.data< PlacementEdgeData >().branch_length } );
+  }
+  return result;
+}
+
+/**
+ * Placement masses of a sample, per edge index, as (proximal length, mass) pairs
+ * sorted by position. The masses of a sample sum up to one.
+ */
+using EdgeMasses = std::vector< std::vector< std::pair< double, double > > >;
+
+void sort_and_normalize( EdgeMasses& result, double const total )
+{
+  for( auto& masses : result ) {
+    std::sort( masses.begin(), masses.end() );
+    if( total > 0.0 ) {
+      for( auto& m : masses ) {
+        m.second /= total;
+      }
+    }
+  }
+}
+
+EdgeMasses edge_masses( Sample const& sample )
+{
+  EdgeMasses result( sample.tree().edge_count() );
+  double total = 0.0;
+
+  for( auto const& pq : sample ) {
+    double const mult = total_multiplicity( pq );
+    for( auto const& p : pq.placements() ) {
+      auto const mass = p.like_weight_ratio * mult;
+      result[ p.edge().index() ].emplace_back( p.proximal_length, mass );
+      total += mass;
+    }
+  }
+
+  sort_and_normalize( result, total );
+  return result;
+}
+
 /**
- *  Outputs a pairwise Phylogenetic Kantorovic-Rubinstein distance matrix for an arbitrary number of jplace files
+ * Same for one sample of a container, whose pqueries carry the multiplicity they have in that
+ * sample instead of their own.
+ */
+EdgeMasses edge_masses( ContainerSample const& sample )
+{
+  EdgeMasses result( sample.tree().edge_count() );
+  double total = 0.0;
+
+  for( size_t k = 0; k < sample.size(); ++k ) {
+    double const mult = sample.multiplicity_at( k );
+    for( auto const& p : sample.pquery_at( k ).placements() ) {
+      auto const mass = p.like_weight_ratio * mult;
+      result[ p.edge().index() ].emplace_back( p.proximal_length, mass );
+      total += mass;
+    }
+  }
+
+  sort_and_normalize( result, total );
+  return result;
+}
+
+/**
+ * KR distances between two mass profiles on the same topology, one for each exponent p.
+ *
+ * The masses of lhs are positive and those of rhs negative; the work needed to move the
+ * net mass across each edge is accumulated while walking the tree bottom-up. The mass flow
+ * does not depend on p, so all exponents share the same walk.
+ */
+std::vector< double > pairwise_krd( std::vector< TopologyEdge > const& topology,
+                                    size_t const node_count,
+                                    EdgeMasses const& lhs,
+                                    EdgeMasses const& rhs,
+                                    std::vector< double > const& exponents )
+{
+  std::vector< double > node_mass( node_count, 0.0 );
+  std::vector< double > work( exponents.size(), 0.0 );
+
+  auto add_work = [&]( double const mass, double const len ) {
+    auto const abs_mass = std::abs( mass );
+    for( size_t e = 0; e < exponents.size(); ++e ) {
+      work[ e ] += ( exponents[ e ] == 1.0 ? abs_mass : std::pow( abs_mass, exponents[ e ] ) ) * len;
+    }
+  };
+
+  for( auto const& edge : topology ) {
+    auto const& lhs_masses = lhs[ edge.edge_index ];
+    auto const& rhs_masses = rhs[ edge.edge_index ];
+
+    // walk from the distal end of the edge towards the proximal one
+    double cur_pos  = edge.branch_length;
+    double cur_mass = node_mass[ edge.lower_node ];
+    auto l_it       = lhs_masses.crbegin();
+    auto r_it       = rhs_masses.crbegin();
+
+    while( l_it != lhs_masses.crend() or r_it != rhs_masses.crend() ) {
+      double pos;
+      double delta;
+      if( r_it == rhs_masses.crend()
+          or ( l_it != lhs_masses.crend() and l_it->first >= r_it->first ) ) {
+        pos   = l_it->first;
+        delta = l_it->second;
+        ++l_it;
+      } else {
+        pos   = r_it->first;
+        delta = -r_it->second;
+        ++r_it;
+      }
+
+      add_work( cur_mass, cur_pos - pos );
+      cur_pos = pos;
+      cur_mass += delta;
+    }
+    add_work( cur_mass, cur_pos );
+
+    node_mass[ edge.upper_node ] += cur_mass;
+  }
+
+  for( size_t e = 0; e < exponents.size(); ++e ) {
+    work[ e ] = std::pow( work[ e ], 1.0 / exponents[ e ] );
+  }
+  return work;
+}
+
+// -------------------------------------------------------------------------
+//     Checkpointing
+// -------------------------------------------------------------------------
+
+/**
+ * The checkpoint file starts with a header identifying the run, followed by one record per
+ * finished block of rows: the block index, then the upper triangle values of its rows,
+ * for each exponent in turn. A record that was only partially written (e.g. when the job
+ * was killed) is discarded.
+ */
+constexpr uint64_t CHECKPOINT_MAGIC = 0x4b52444d41545032; // "KRDMATP2"
+
+struct CheckpointHeader {
+  uint64_t magic;
+  uint64_t num_samples;
+  uint64_t block_size;
+  uint64_t num_exponents;
+  uint64_t run_hash;
+};
+
+size_t block_value_count( size_t const n, size_t const row_begin, size_t const row_end )
+{
+  size_t count = 0;
+  for( size_t i = row_begin; i < row_end; ++i ) {
+    count += n - i - 1;
+  }
+  return count;
+}
+
+void write_block( std::ostream& os,
+                  std::vector< Matrix< double > > const& krd_matrices,
+                  uint64_t const block,
+                  size_t const row_begin,
+                  size_t const row_end )
+{
+  auto const n = krd_matrices[ 0 ].rows();
+  std::vector< double > values;
+  values.reserve( krd_matrices.size() * block_value_count( n, row_begin, row_end ) );
+  for( auto const& krd_matrix : krd_matrices ) {
+    for( size_t i = row_begin; i < row_end; ++i ) {
+      for( size_t j = i + 1; j < n; ++j ) {
+        values.push_back( krd_matrix.at( i, j ) );
+      }
+    }
+  }
+
+  os.write( reinterpret_cast< char const* >( &block ), sizeof( block ) );
+  os.write( reinterpret_cast< char const* >( values.data() ), values.size() * sizeof( double ) );
+}
+
+/**
+ * Reads all complete blocks of a checkpoint into the matrices, and returns which blocks are done.
+ */
+std::vector< bool > read_checkpoint( std::string const& file,
+                                     CheckpointHeader const& expected,
+                                     std::vector< Matrix< double > >& krd_matrices,
+                                     size_t const num_blocks )
+{
+  std::vector< bool > done( num_blocks, false );
+  auto const n          = krd_matrices[ 0 ].rows();
+  auto const block_size = expected.block_size;
+
+  std::ifstream is( file, std::ios::binary );
+  if( not is ) {
+    return done;
+  }
+
+  CheckpointHeader header;
+  is.read( reinterpret_cast< char* >( &header ), sizeof( header ) );
+  fail( not is or header.magic != CHECKPOINT_MAGIC, "Not a checkpoint file: " + file );
+  fail( header.num_samples != expected.num_samples or header.block_size != expected.block_size
+            or header.num_exponents != expected.num_exponents or header.run_hash != expected.run_hash,
+        "Checkpoint file " + file
+            + " belongs to a different run (input files, exponents or block size differ)." );
+
+  uint64_t block;
+  std::vector< double > values;
+  while( is.read( reinterpret_cast< char* >( &block ), sizeof( block ) ) ) {
+    if( block >= num_blocks ) {
+      break;
+    }
+    auto const row_begin = block * block_size;
+    auto const row_end   = std::min< size_t >( row_begin + block_size, n );
+    values.resize( krd_matrices.size() * block_value_count( n, row_begin, row_end ) );
+    if( not is.read( reinterpret_cast< char* >( values.data() ), values.size() * sizeof( double ) ) ) {
+      break;
+    }
+
+    size_t k = 0;
+    for( auto& krd_matrix : krd_matrices ) {
+      for( size_t i = row_begin; i < row_end; ++i ) {
+        for( size_t j = i + 1; j < n; ++j ) {
+          krd_matrix.at( i, j ) = krd_matrix.at( j, i ) = values[ k++ ];
+        }
+      }
+    }
+    done[ block ] = true;
+  }
+
+  return done;
+}
+
+std::string format_duration( double seconds )
+{
+  auto const total = static_cast< size_t >( seconds );
+  return std::to_string( total / 3600 ) + "h " + std::to_string( ( total / 60 ) % 60 ) + "m "
+         + std::to_string( total % 60 ) + "s";
+}
+
+/**
+ *  Outputs a pairwise Phylogenetic Kantorovic-Rubinstein distance matrix for an arbitrary number of jplace files.
+ *  With several exponents, one matrix per exponent is written to <out-prefix>krd_p<exponent>.csv
+ *  With --container, the samples are those of a single sample container written by persample.
  */
 int main( int argc, char** argv )
 {
-  if( argc < 2 ) {
-    throw std::runtime_error(
-        std::string( "Usage: " ) + argv[ 0 ] + " <jplace-files...>" );
+  std::string const usage = std::string( "Usage: " ) + argv[ 0 ]
+                            + " [--exponents <p,...>] [--out-prefix <prefix>]"
+                            + " [--checkpoint <file>] [--resume] [--block-size <rows>]"
+                            + " (<jplace-files...> | --container <container-file>)";
+
+  // the matrix goes to stdout, so log to stderr
+  Logging::log_to_stream( std::cerr );
+  Logging::details.time = true;
+
+  // Options, which precede the jplace files.
+  std::vector< double > exponents = { 1.0 };
+  std::string out_prefix;
+  std::string checkpoint_file;
+  bool resume       = false;
+  bool container    = false;
+  size_t block_size = 16;
+
+  int arg = 1;
+  for( ; arg < argc and std::string( argv[ arg ] ).substr( 0, 2 ) == "--"; ++arg ) {
+    std::string const opt( argv[ arg ] );
+    if( opt == "--resume" ) {
+      resume = true;
+    } else if( opt == "--container" ) {
+      container = true;
+    } else if( opt == "--exponents" and arg + 1 < argc ) {
+      exponents.clear();
+      for( auto const& e : split( argv[ ++arg ], "," ) ) {
+        exponents.push_back( std::stod( e ) );
+      }
+    } else if( opt == "--out-prefix" and arg + 1 < argc ) {
+      out_prefix = argv[ ++arg ];
+    } else if( opt == "--checkpoint" and arg + 1 < argc ) {
+      checkpoint_file = argv[ ++arg ];
+    } else if( opt == "--block-size" and arg + 1 < argc ) {
+      block_size = std::stoul( argv[ ++arg ] );
+    } else {
+      throw std::runtime_error( "Unknown option: " + opt + "\n" + usage );
+    }
   }
 
+  if( argc - arg < 1 ) {
+    throw std::runtime_error( usage );
+  }
+  fail( container and argc - arg != 1, "--container takes a single container file\n" + usage );
+  fail( resume and checkpoint_file.empty(), "--resume requires --checkpoint <file>" );
+  fail( block_size == 0, "--block-size must be at least 1" );
+  fail( exponents.empty(), "--exponents needs at least one value" );
+  for( auto const e : exponents ) {
+    fail( not( e > 0.0 ), "KRD exponents must be positive" );
+  }
+  fail( exponents.size() > 1 and out_prefix.empty(),
+        "Several exponents produce several matrices, which requires --out-prefix <prefix>" );
+
   // In out dirs.
   std::vector< std::string > jplace_paths;
-  for( int i = 1; i < argc; ++i ) {
+  for( int i = arg; i < argc; ++i ) {
     jplace_paths.push_back( std::string( argv[ i ] ) );
   }
 
-  JplaceReader jplace_reader;
-  auto sample_set = jplace_reader.read( from_files( jplace_paths ) );
+  // all samples are placed on the same reference tree, so we only need its topology once
+  std::vector< std::string > names;
+  std::vector< TopologyEdge > topology;
+  size_t node_count = 0;
+  std::vector< EdgeMasses > masses;
+
+  if( container ) {
+    // the samples are views on the pooled sample, so it is never expanded into one per sample
+    auto const samples = read_sample_container( jplace_paths[ 0 ] );
+    fail( samples.size() == 0, "No samples in container " + jplace_paths[ 0 ] );
+    names      = samples.sample_names;
+    topology   = postorder_edges( samples.sample.tree() );
+    node_count = samples.sample.tree().node_count();
+
+    masses.resize( samples.size() );
+#pragma omp parallel for schedule( dynamic )
+    for( size_t i = 0; i < samples.size(); ++i ) {
+      masses[ i ] = edge_masses( samples.at( i ) );
+    }
+  } else {
+    JplaceReader jplace_reader;
+    auto sample_set = jplace_reader.read( from_files( jplace_paths ) );
+
+    for( auto& sample : sample_set ) {
+      normalize( sample );
+    }
 
-  for( auto& sample : sample_set ) {
-    normalize( sample );
+    for( auto const& name : sample_set.names() ) {
+      names.push_back( name );
+    }
+
+    topology   = postorder_edges( sample_set.at( 0 ).tree() );
+    node_count = sample_set.at( 0 ).tree().node_count();
+
+    masses.resize( sample_set.size() );
+#pragma omp parallel for schedule( dynamic )
+    for( size_t i = 0; i < sample_set.size(); ++i ) {
+      masses[ i ] = edge_masses( sample_set.at( i ) );
+    }
   }
 
-  auto const pwdmat = earth_movers_distance( sample_set );
+  size_t const n = names.size();
 
-  std::vector< std::string > names;
-  for( auto const& name : sample_set.names() ) {
-    names.push_back( name );
+  std::vector< Matrix< double > > krd_matrices( exponents.size(), Matrix< double >( n, n, 0.0 ) );
+
+  // blocks of consecutive rows of the upper triangle
+  size_t const num_blocks = ( n + block_size - 1 ) / block_size;
+  std::vector< bool > done( num_blocks, false );
+
+  CheckpointHeader header;
+  header.magic       = CHECKPOINT_MAGIC;
+  header.num_samples = n;
+  header.block_size    = block_size;
+  header.num_exponents = exponents.size();
+  header.run_hash      = std::hash< std::string >()( join( names, "\n" ) + "\n" + join( exponents, "," ) );
+
+  if( resume ) {
+    done = read_checkpoint( checkpoint_file, header, krd_matrices, num_blocks );
   }
 
-  MatrixWriter< double >().write( pwdmat, to_stream( std::cout ), {}, names );
+  // (re)write the checkpoint with only the complete blocks, dropping any partial record. this goes
+  // to a temporary file first, which only replaces the old checkpoint once it is complete, so that
+  // a crash in between never loses blocks that were already done.
+  std::ofstream checkpoint;
+  if( not checkpoint_file.empty() ) {
+    auto const tmp_file = checkpoint_file + ".tmp";
+    std::ofstream rewrite( tmp_file, std::ios::binary | std::ios::trunc );
+    fail( not rewrite, "Cannot write checkpoint file: " + tmp_file );
+    rewrite.write( reinterpret_cast< char const* >( &header ), sizeof( header ) );
+    for( size_t b = 0; b < num_blocks; ++b ) {
+      if( done[ b ] ) {
+        write_block( rewrite, krd_matrices, b, b * block_size, std::min( ( b + 1 ) * block_size, n ) );
+      }
+    }
+    rewrite.close();
+    fail( not rewrite, "Cannot write checkpoint file: " + tmp_file );
+    fail( std::rename( tmp_file.c_str(), checkpoint_file.c_str() ) != 0,
+          "Cannot replace checkpoint file: " + checkpoint_file );
+
+    // from here on, finished blocks are only appended
+    checkpoint.open( checkpoint_file, std::ios::binary | std::ios::app );
+    fail( not checkpoint, "Cannot write checkpoint file: " + checkpoint_file );
+  }
+
+  size_t total_pairs = 0;
+  size_t todo_pairs  = 0;
+  for( size_t b = 0; b < num_blocks; ++b ) {
+    auto const pairs = block_value_count( n, b * block_size, std::min( ( b + 1 ) * block_size, n ) );
+    total_pairs += pairs;
+    if( not done[ b ] ) {
+      todo_pairs += pairs;
+    }
+  }
+  LOG_INFO << "Computing " << todo_pairs << " of " << total_pairs << " pairs in "
+           << std::count( done.begin(), done.end(), false ) << " blocks";
+
+  auto const start = std::chrono::steady_clock::now();
+  size_t pairs_done = 0;
+
+  for( size_t b = 0; b < num_blocks; ++b ) {
+    if( done[ b ] ) {
+      continue;
+    }
+    size_t const row_begin = b * block_size;
+    size_t const row_end   = std::min( row_begin + block_size, n );
+
+    std::vector< std::pair< size_t, size_t > > idx;
+    for( size_t i = row_begin; i < row_end; ++i ) {
+      for( size_t j = i + 1; j < n; ++j ) {
+        idx.emplace_back( i, j );
+      }
+    }
+
+#pragma omp parallel for schedule( dynamic )
+    for( size_t k = 0; k < idx.size(); ++k ) {
+      size_t const i  = idx[ k ].first;
+      size_t const j  = idx[ k ].second;
+      auto const krds = pairwise_krd( topology, node_count, masses[ i ], masses[ j ], exponents );
+      for( size_t e = 0; e < exponents.size(); ++e ) {
+        krd_matrices[ e ].at( i, j ) = krd_matrices[ e ].at( j, i ) = krds[ e ];
+      }
+    }
+
+    if( checkpoint.is_open() ) {
+      write_block( checkpoint, krd_matrices, b, row_begin, row_end );
+      checkpoint.flush();
+      fail( not checkpoint, "Cannot write checkpoint file: " + checkpoint_file );
+    }
+
+    // progress and ETA. the last row has no pairs, so a block of only that row has nothing to report
+    if( idx.empty() ) {
+      continue;
+    }
+    pairs_done += idx.size();
+    double const elapsed = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+    double const eta     = pairs_done ? elapsed / pairs_done * ( todo_pairs - pairs_done ) : 0.0;
+    LOG_INFO << "Block " << ( b + 1 ) << " of " << num_blocks << ": " << pairs_done << " / " << todo_pairs
+             << " pairs, elapsed " << format_duration( elapsed ) << ", ETA " << format_duration( eta );
+  }
+
+  if( out_prefix.empty() ) {
+    MatrixWriter< double >().write( krd_matrices[ 0 ], to_stream( std::cout ), {}, names );
+  } else {
+    for( size_t e = 0; e < exponents.size(); ++e ) {
+      auto const out_file = out_prefix + "krd_p" + to_string_rounded( exponents[ e ] ) + ".csv";
+      MatrixWriter< double >().write( krd_matrices[ e ], to_file( out_file ), {}, names );
+      LOG_INFO << "Wrote " << out_file;
+    }
+  }
 
   return 0;
 }
@@ -0,0 +1,70 @@
+#include "genesis/genesis.hpp"
+
+#include <stdexcept>
+#include <vector>
+
+/**
+ * Edge of the lowest common ancestor of the given nodes: of all the edges that have the selected
+ * leaves entirely on one side, the one where that side holds the fewest leaves.
+ *
+ * This is the edge that find_smallest_subtree() finds on a bipartition_set(), but from a single
+ * postorder traversal that counts the leaves and the selected leaves below each edge, in linear
+ * time and memory instead of one leaf bitvector per edge.
+ */
+inline genesis::tree::TreeEdge& lowest_common_ancestor( genesis::tree::Tree& tree,
+                                                         std::vector< genesis::tree::TreeNode const* > const& nodes )
+{
+  using namespace genesis::tree;
+
+  // per node index, counted for the subtree below it, that is, away from the root
+  std::vector< size_t > leaves( tree.node_count(), 0 );
+  std::vector< size_t > selected( tree.node_count(), 0 );
+
+  size_t total_selected = 0;
+  for( auto const node : nodes ) {
+    if( is_leaf( *node ) and selected[ node->index() ] == 0 ) {
+      selected[ node->index() ] = 1;
+      ++total_selected;
+    }
+  }
+  if( total_selected == 0 ) {
+    throw std::invalid_argument{ "Rooting could not be determined." };
+  }
+
+  for( auto const& node : tree.nodes() ) {
+    if( is_leaf( node ) ) {
+      leaves[ node.index() ] = 1;
+    }
+  }
+  auto const total_leaves = leaf_node_count( tree );
+
+  for( auto it : postorder( tree ) ) {
+    if( it.is_last_iteration() ) {
+      continue;
+    }
+    auto const node   = it.node().index();
+    auto const parent = it.edge().primary_node().index();
+    leaves[ parent ] += leaves[ node ];
+    selected[ parent ] += selected[ node ];
+  }
+
+  // either the subtree below an edge holds all selected leaves, or the rest of the tree does
+  TreeEdge* best   = nullptr;
+  size_t best_size = 0;
+  for( auto& edge : tree.edges() ) {
+    auto const below = edge.secondary_node().index();
+    if( selected[ below ] == total_selected and ( not best or leaves[ below ] < best_size ) ) {
+      best      = &edge;
+      best_size = leaves[ below ];
+    }
+    if( selected[ below ] == 0 and ( not best or total_leaves - leaves[ below ] < best_size ) ) {
+      best      = &edge;
+      best_size = total_leaves - leaves[ below ];
+    }
+  }
+
+  if( not best ) {
+    throw std::invalid_argument{ "Rooting could not be determined." };
+  }
+  return *best;
+}
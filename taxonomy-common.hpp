@@ -0,0 +1,242 @@
+#include "genesis/genesis.hpp"
+
+#include <functional>
+#include <limits>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+constexpr char UNDETERMINED[] = "N/A";
+constexpr char QUERY[]        = "query";
+
+/**
+ * Taxonomic paths as nodes of a trie, so that a label is just an index, and the longest common
+ * prefix of two labels is the lowest common ancestor of their nodes. The root stands for an
+ * undetermined label, and a separate sentinel marks nodes that are not labelled yet.
+ */
+class TaxonomyTrie
+{
+public:
+  enum : size_t { ROOT = 0, QUERY_ID = 1 };
+
+  TaxonomyTrie()
+  {
+    nodes_.push_back( { UNDETERMINED, ROOT, 0, {} } );
+    nodes_.push_back( { QUERY, QUERY_ID, 0, {} } );
+  }
+
+  /**
+   * Id of the given path, adding its nodes if needed.
+   */
+  size_t insert( genesis::taxonomy::Taxopath const& path )
+  {
+    size_t id = ROOT;
+    for( auto const& rank : path ) {
+      auto const it = nodes_[ id ].children.find( rank );
+      if( it != nodes_[ id ].children.end() ) {
+        id = it->second;
+      } else {
+        auto const child = nodes_.size();
+        nodes_.push_back( { rank, id, nodes_[ id ].depth + 1, {} } );
+        nodes_[ id ].children.emplace( rank, child );
+        id = child;
+      }
+    }
+    return id;
+  }
+
+  size_t intersect( size_t lhs, size_t rhs ) const
+  {
+    // short-circuit if one is coming from a label: in that case ignore the query label
+    if( lhs == QUERY_ID ) {
+      return rhs;
+    }
+    if( rhs == QUERY_ID ) {
+      return lhs;
+    }
+
+    // lowest common ancestor, which is the root if the paths do not share their first rank
+    while( nodes_[ lhs ].depth > nodes_[ rhs ].depth ) {
+      lhs = nodes_[ lhs ].parent;
+    }
+    while( nodes_[ rhs ].depth > nodes_[ lhs ].depth ) {
+      rhs = nodes_[ rhs ].parent;
+    }
+    while( lhs != rhs ) {
+      lhs = nodes_[ lhs ].parent;
+      rhs = nodes_[ rhs ].parent;
+    }
+    return lhs;
+  }
+
+  genesis::taxonomy::Taxopath path( size_t id ) const
+  {
+    if( id == ROOT or id == QUERY_ID ) {
+      return genesis::taxonomy::Taxopath( { nodes_[ id ].rank } );
+    }
+    std::vector< std::string > ranks( nodes_[ id ].depth );
+    for( ; id != ROOT; id = nodes_[ id ].parent ) {
+      ranks[ nodes_[ id ].depth - 1 ] = nodes_[ id ].rank;
+    }
+    return genesis::taxonomy::Taxopath( ranks );
+  }
+
+  size_t parent( size_t const id ) const
+  {
+    return nodes_[ id ].parent;
+  }
+
+  size_t depth( size_t const id ) const
+  {
+    return nodes_[ id ].depth;
+  }
+
+  std::string to_string( size_t const id ) const
+  {
+    return genesis::taxonomy::TaxopathGenerator().to_string( path( id ) );
+  }
+
+private:
+  struct Node {
+    std::string rank;
+    size_t parent;
+    size_t depth;
+    // ids of the children, by the name of their rank
+    std::unordered_map< std::string, size_t > children;
+  };
+
+  std::vector< Node > nodes_;
+};
+
+/**
+ * The taxon file, parsed once: the label of every named taxon, as a node of the trie.
+ * It does not depend on any tree, so it can be shared by all trees that get labelled.
+ */
+struct Taxonomy {
+  TaxonomyTrie trie;
+  std::unordered_map< std::string, size_t > labels;
+};
+
+inline Taxonomy read_taxonomy( std::string const& taxon_file )
+{
+  using namespace genesis;
+
+  taxonomy::TaxopathParser tpp;
+  utils::CsvReader csv_reader;
+  csv_reader.separator_chars( "\t" );
+  Taxonomy taxonomy;
+
+  utils::InputStream it( utils::make_unique< utils::FileInputSource >( taxon_file ) );
+  while( it ) {
+    auto fields = csv_reader.parse_line( it );
+
+    if( fields.size() != 2 ) {
+      throw std::runtime_error{ "A line in the taxon file didn't have two tab separated columns." };
+    }
+
+    auto const& name       = fields[ 0 ];
+    auto const& tax_string = fields[ 1 ];
+
+    taxonomy.labels[ name ] = taxonomy.trie.insert( tpp.parse( tax_string ) );
+  }
+
+  return taxonomy;
+}
+
+inline std::vector< size_t > label_nodes( genesis::tree::Tree const& tree,
+                                          Taxonomy const& taxonomy )
+{
+  using namespace genesis::tree;
+
+  auto const& trie = taxonomy.trie;
+  std::vector< size_t > node_labels( tree.node_count(), TaxonomyTrie::QUERY_ID );
+
+  // look up every named node in the taxonomy, instead of searching the tree for every taxon
+  std::unordered_set< std::string > found;
+  for( auto const& node : tree.nodes() ) {
+    auto const& name = node.data< CommonNodeData >().name;
+    auto const it    = name.empty() ? taxonomy.labels.end() : taxonomy.labels.find( name );
+    if( it != taxonomy.labels.end() ) {
+      node_labels[ node.index() ] = it->second;
+      found.insert( name );
+    }
+  }
+
+  if( found.size() != taxonomy.labels.size() ) {
+    for( auto const& entry : taxonomy.labels ) {
+      if( found.count( entry.first ) == 0 ) {
+        throw std::runtime_error{ "Could not find node with name: " + entry.first };
+      }
+    }
+  }
+
+  // check if any leafs weren't assigned a Taxopath
+  // for ( auto const& node_it : tree.nodes() ) {
+  //     if ( node_it->is_leaf() and node_labels[ node_it->index() ].empty() ) {
+  //         auto name = node_it->data< CommonNodeData >().name;
+  //         throw std::runtime_error{"The leaf in the tree labelled '" + name
+  //             + "' wasn't assigned a taxonomic path. Did you forget to include it in the taxon file?"};
+  //     }
+  // }
+  // go through the tree in postorder fashion and label inner nodes according to the most common taxonomic rank of the children
+  for( auto it : postorder( tree ) ) {
+    if( is_inner( it.node() ) ) {
+      auto const child_1_idx = it.node().link().next().outer().node().index();
+      auto const child_2_idx = it.node().link().next().next().outer().node().index();
+
+      node_labels[ it.node().index() ] = trie.intersect( node_labels[ child_1_idx ], node_labels[ child_2_idx ] );
+    }
+  }
+
+  return node_labels;
+}
+
+/**
+ * Gives every unlabelled node the label of its nearest labelled node, by path length, through a
+ * shortest path search started from all labelled nodes at once. Ties go to the node reached first.
+ */
+inline void propagate_labels( genesis::tree::Tree const& tree, std::vector< size_t >& node_labels )
+{
+  using namespace genesis::tree;
+
+  using Entry = std::pair< double, size_t >;
+
+  std::vector< double > dist( tree.node_count(), std::numeric_limits< double >::infinity() );
+  std::priority_queue< Entry, std::vector< Entry >, std::greater< Entry > > queue;
+  for( size_t i = 0; i < tree.node_count(); ++i ) {
+    if( node_labels[ i ] != TaxonomyTrie::QUERY_ID ) {
+      dist[ i ] = 0.0;
+      queue.emplace( 0.0, i );
+    }
+  }
+
+  if( queue.empty() ) {
+    throw std::runtime_error{ "None of the tips had labels!" };
+  }
+
+  while( not queue.empty() ) {
+    auto const entry = queue.top();
+    queue.pop();
+    auto const u = entry.second;
+    if( entry.first > dist[ u ] ) {
+      continue;
+    }
+
+    auto const& start = tree.node_at( u ).link();
+    auto const* link  = &start;
+    do {
+      auto const v = link->outer().node().index();
+      auto const d = dist[ u ] + link->edge().data< CommonEdgeData >().branch_length;
+      if( d < dist[ v ] ) {
+        dist[ v ]        = d;
+        node_labels[ v ] = node_labels[ u ];
+        queue.emplace( d, v );
+      }
+      link = &link->next();
+    } while( link != &start );
+  }
+}